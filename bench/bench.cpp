@@ -0,0 +1,361 @@
+/* Codecat Preprocessor microbenchmarks
+ *
+ * Runs process() over synthetic inputs and reports throughput for each scenario
+ * as one JSON object per line.
+ *
+ * Build and run:
+ *   g++ -O2 -std=c++17 -o ccpp_bench bench/bench.cpp
+ *   ./ccpp_bench [scenario filter]
+ *
+ * Add -DCCPP_STATS to measure with statistics enabled.
+ *
+ * Also checks that process() doesn't allocate on a processor that is already set up,
+ * unless the input has definitions of its own. The exit code is 1 if it does. Allocations
+ * made with the global operator new are counted too, those are never allowed.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <new>
+
+#define CCPP_IMPL
+#include "../ccpp.h"
+
+struct scenario
+{
+	const char* name;
+
+	std::string input;
+	size_t directives;
+
+	std::vector<std::string> defines;
+};
+
+static size_t count_directives(const std::string &input)
+{
+	size_t ret = 0;
+	for (size_t i = 0; i < input.size(); i++) {
+		if (input[i] == ccpp::character && (i == 0 || input[i - 1] == '\n')) {
+			ret++;
+		}
+	}
+	return ret;
+}
+
+static void append_code_line(std::string &out, int i)
+{
+	out += "\tint value";
+	out += std::to_string(i);
+	out += " = GetSomething(\"text\", ";
+	out += std::to_string(i * 7);
+	out += ") + other.Member;\n";
+}
+
+// Plain script text without any directives
+static void gen_plain(scenario &s, size_t size)
+{
+	s.input.reserve(size + 128);
+	for (int i = 0; s.input.size() < size; i++) {
+		if (i % 20 == 0) {
+			s.input += "void Function";
+			s.input += std::to_string(i);
+			s.input += "()\n{\n";
+		}
+		append_code_line(s.input, i);
+		if (i % 20 == 19) {
+			s.input += "}\n\n";
+		}
+	}
+}
+
+// Short blocks of code surrounded by every kind of directive
+static void gen_directive_dense(scenario &s, size_t size)
+{
+	s.defines.push_back("FEATURE_A");
+	s.defines.push_back("FEATURE_3");
+
+	s.input.reserve(size + 256);
+	for (int i = 0; s.input.size() < size; i++) {
+		std::string n = std::to_string(i);
+		s.input += "#define LOCAL_" + n + " " + n + "\n";
+		s.input += "#if (defined(FEATURE_A) && !FEATURE_B) || FEATURE_" + std::to_string(i % 8) + "\n";
+		append_code_line(s.input, i);
+		s.input += "#elif LOCAL_" + n + " > 100\n";
+		append_code_line(s.input, i);
+		s.input += "#else\n";
+		append_code_line(s.input, i);
+		s.input += "#endif\n";
+		s.input += "#undef LOCAL_" + n + "\n";
+	}
+}
+
+// Deeply nested conditions, alternating between passing and erasing
+static void gen_deep_nesting(scenario &s, size_t size)
+{
+	const int depth = 200;
+
+	s.defines.push_back("A");
+
+	s.input.reserve(size + 4096);
+	while (s.input.size() < size) {
+		for (int d = 0; d < depth; d++) {
+			s.input += (d % 50 == 49) ? "#if !A\n" : "#if A\n";
+			append_code_line(s.input, d);
+		}
+		for (int d = 0; d < depth; d++) {
+			s.input += "#endif\n";
+		}
+	}
+}
+
+// Conditions with many terms
+static void gen_long_conditions(scenario &s, size_t size)
+{
+	const int terms = 64;
+
+	s.defines.push_back("TERM_63");
+
+	std::string condition;
+	for (int t = 0; t < terms; t++) {
+		if (t > 0) {
+			condition += (t % 4 == 0) ? " || " : " && ";
+		}
+		condition += (t % 3 == 0) ? "!" : "";
+		condition += "TERM_" + std::to_string(t);
+	}
+
+	s.input.reserve(size + 1024);
+	for (int i = 0; s.input.size() < size; i++) {
+		s.input += "#if " + condition + "\n";
+		append_code_line(s.input, i);
+		s.input += "#endif\n";
+	}
+}
+
+// Lots of definitions that conditions look up
+static void gen_many_defines(scenario &s, size_t size)
+{
+	const int count = 10000;
+
+	for (int i = 0; i < count; i++) {
+		s.defines.push_back("DEFINE_" + std::to_string(i));
+	}
+
+	s.input.reserve(size + 256);
+	for (int i = 0; s.input.size() < size; i++) {
+		// Look up both existing and missing definitions
+		s.input += "#if DEFINE_" + std::to_string((i * 7919) % (count * 2)) + "\n";
+		append_code_line(s.input, i);
+		s.input += "#endif\n";
+	}
+}
+
+// Large regions that are erased
+static void gen_erased_regions(scenario &s, size_t size)
+{
+	const int lines = 2000;
+
+	s.input.reserve(size + lines * 64);
+	while (s.input.size() < size) {
+		s.input += "#if NOT_DEFINED\n";
+		for (int i = 0; i < lines; i++) {
+			append_code_line(s.input, i);
+		}
+		s.input += "#endif\n";
+	}
+}
+
+// Counts allocations made with the global operator new while enabled
+static bool g_countHeap = false;
+static size_t g_heapAllocations = 0;
+
+void* operator new(size_t size)
+{
+	if (g_countHeap) {
+		g_heapAllocations++;
+	}
+	void* p = malloc(size > 0 ? size : 1);
+	if (p == nullptr) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	free(p);
+}
+
+// Counts allocations made through it
+class counting_allocator : public ccpp::allocator
+{
+public:
+	size_t count = 0;
+
+	virtual void* allocate(size_t size) override
+	{
+		count++;
+		return ccpp::default_allocator()->allocate(size);
+	}
+
+	virtual void deallocate(void* p, size_t size) override
+	{
+		ccpp::default_allocator()->deallocate(p, size);
+	}
+};
+
+struct result
+{
+	size_t iterations;
+	double seconds;
+	size_t allocations;
+	size_t heapAllocations;
+};
+
+// Counts the allocations of a process() run after a first run has warmed up the processor
+static void count_allocations(const scenario &s, result &r)
+{
+	counting_allocator alloc;
+	ccpp::processor p(&alloc);
+	for (const std::string &name : s.defines) {
+		p.add_define(name);
+	}
+
+	std::vector<char> buffer(s.input.size() + 1);
+	for (int i = 0; i < 2; i++) {
+		memcpy(buffer.data(), s.input.data(), s.input.size() + 1);
+		alloc.count = 0;
+		g_heapAllocations = 0;
+		g_countHeap = true;
+		p.process(buffer.data(), s.input.size());
+		g_countHeap = false;
+	}
+	r.allocations = alloc.count;
+	r.heapAllocations = g_heapAllocations;
+}
+
+static result run_scenario(const scenario &s)
+{
+	ccpp::config cfg;
+	for (const std::string &name : s.defines) {
+		cfg.add_define(name);
+	}
+	cfg.freeze();
+
+	std::vector<char> buffer(s.input.size() + 1);
+	std::vector<double> times;
+
+	// Run for at least half a second, and at least 5 times
+	double total = 0;
+	while (times.size() < 5 || total < 0.5) {
+		memcpy(buffer.data(), s.input.data(), s.input.size() + 1);
+
+		// Creating the session is part of the run
+		auto start = std::chrono::steady_clock::now();
+		{
+			ccpp::session session(cfg);
+#if defined(CCPP_STATS)
+			ccpp::session::stats stats;
+			session.set_stats(&stats);
+#endif
+			session.process(buffer.data(), s.input.size());
+		}
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		times.push_back(seconds);
+		total += seconds;
+	}
+
+	// Report the median
+	std::sort(times.begin(), times.end());
+
+	result ret;
+	ret.iterations = times.size();
+	ret.seconds = times[times.size() / 2];
+	count_allocations(s, ret);
+	return ret;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* filter = (argc > 1) ? argv[1] : nullptr;
+	const size_t size = 4 * 1024 * 1024;
+
+	struct
+	{
+		const char* name;
+		void(*generate)(scenario &s, size_t size);
+	} generators[] = {
+		{ "plain_text", gen_plain },
+		{ "directive_dense", gen_directive_dense },
+		{ "deep_nesting", gen_deep_nesting },
+		{ "long_conditions", gen_long_conditions },
+		{ "many_defines", gen_many_defines },
+		{ "erased_regions", gen_erased_regions },
+	};
+
+	int ret = 0;
+
+	for (auto &gen : generators) {
+		if (filter != nullptr && strstr(gen.name, filter) == nullptr) {
+			continue;
+		}
+
+		scenario s;
+		s.name = gen.name;
+		gen.generate(s, size);
+		s.directives = count_directives(s.input);
+
+		result r = run_scenario(s);
+
+		printf("{\"scenario\":\"%s\",\"bytes\":%zu,\"directives\":%zu,\"iterations\":%zu,\"ns_per_run\":%.0f,\"bytes_per_sec\":%.0f,\"directives_per_sec\":%.0f,\"allocations\":%zu,\"heap_allocations\":%zu}\n",
+			s.name,
+			s.input.size(),
+			s.directives,
+			r.iterations,
+			r.seconds * 1e9,
+			s.input.size() / r.seconds,
+			s.directives / r.seconds,
+			r.allocations,
+			r.heapAllocations
+		);
+		fflush(stdout);
+
+		// Only definitions made by the input itself need to allocate
+		if (r.allocations > 0 && s.input.find("#define") == std::string::npos) {
+			fprintf(stderr, "%s: process() made %zu allocations\n", s.name, r.allocations);
+			ret = 1;
+		}
+		if (r.heapAllocations > 0) {
+			fprintf(stderr, "%s: process() made %zu allocations with operator new\n", s.name, r.heapAllocations);
+			ret = 1;
+		}
+	}
+
+	return ret;
+}
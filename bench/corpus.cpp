@@ -0,0 +1,558 @@
+/* Codecat Preprocessor corpus benchmark
+ *
+ * Generates a synthetic tree of plugin scripts with shared includes and lots of
+ * definitions, then preprocesses the whole tree through the include callback and
+ * reports wall time, peak memory usage and per-file latency percentiles as JSON.
+ *
+ * Build:
+ *   g++ -O2 -std=c++17 -pthread -o ccpp_corpus bench/corpus.cpp
+ *
+ * Usage:
+ *   ./ccpp_corpus generate <dir> [--plugins N] [--files N] [--shared N] [--fanout N]
+ *                                [--density PERCENT] [--defines N] [--lines N] [--seed N]
+ *   ./ccpp_corpus run <dir> [--repeat N] [--async 0|1] [--prefetch 0|1] [--snapshot 0|1]
+ *                           [--read-latency MICROSECONDS]
+ *
+ * With --async 1, includes are loaded on other threads through the asynchronous include
+ * callbacks. With --prefetch 1, they are loaded ahead of time by a ccpp::prefetcher.
+ * --read-latency adds a delay to every file read, to simulate a cold disk cache.
+ *
+ * With --snapshot 1, the definitions (and with --prefetch 1 also the loaded files) are taken from
+ * <dir>/state.snap, which is saved at the end of the run if it couldn't be loaded.
+ *
+ * The generated tree looks like this:
+ *   <dir>/defines.txt              One "NAME VALUE" definition per line
+ *   <dir>/shared/shared_<n>.as     Shared includes, which may include lower numbered shared includes
+ *   <dir>/plugins/<p>/script_<n>.as
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include <cerrno>
+#include <thread>
+#include <future>
+
+#if defined(_WIN32)
+#  include <windows.h>
+#  include <psapi.h>
+#  include <direct.h>
+#else
+#  include <sys/stat.h>
+#  include <sys/resource.h>
+#endif
+
+#define CCPP_IMPL
+#include "../ccpp.h"
+
+struct options
+{
+	int plugins = 50;
+	int files = 8;
+	int shared = 40;
+	int fanout = 4;
+	int density = 30;
+	int defines = 1000;
+	int lines = 300;
+	uint32_t seed = 1;
+
+	int repeat = 1;
+	int async = 0;
+	int prefetch = 0;
+	int snapshot = 0;
+	int readLatency = 0;
+};
+
+// Small deterministic random number generator, so trees are the same on every platform
+struct rng_state
+{
+	uint32_t state;
+
+	uint32_t next()
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return state;
+	}
+
+	int range(int max)
+	{
+		return (int)(next() % (uint32_t)max);
+	}
+};
+
+static bool make_dir(const std::string &path)
+{
+#if defined(_WIN32)
+	return _mkdir(path.c_str()) == 0 || errno == EEXIST;
+#else
+	return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+#endif
+}
+
+static bool write_file(const std::string &path, const std::string &contents)
+{
+	FILE* fh = fopen(path.c_str(), "wb");
+	if (fh == nullptr) {
+		fprintf(stderr, "Couldn't write \"%s\"\n", path.c_str());
+		return false;
+	}
+	fwrite(contents.data(), 1, contents.size(), fh);
+	fclose(fh);
+	return true;
+}
+
+static char* read_file(const std::string &path, size_t* out_size, int latency = 0)
+{
+	if (latency > 0) {
+		std::this_thread::sleep_for(std::chrono::microseconds(latency));
+	}
+
+	FILE* fh = fopen(path.c_str(), "rb");
+	if (fh == nullptr) {
+		return nullptr;
+	}
+
+	fseek(fh, 0, SEEK_END);
+	size_t size = ftell(fh);
+	fseek(fh, 0, SEEK_SET);
+
+	char* buffer = (char*)malloc(size + 1);
+	if (fread(buffer, 1, size, fh) != size) {
+		free(buffer);
+		fclose(fh);
+		return nullptr;
+	}
+	fclose(fh);
+	buffer[size] = '\0';
+
+	*out_size = size;
+	return buffer;
+}
+
+static size_t peak_rss_kb()
+{
+#if defined(_WIN32)
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) {
+		return 0;
+	}
+	return counters.PeakWorkingSetSize / 1024;
+#else
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#  if defined(__APPLE__)
+	return usage.ru_maxrss / 1024;
+#  else
+	return usage.ru_maxrss;
+#  endif
+#endif
+}
+
+static std::string define_name(int i)
+{
+	return "DEFINE_" + std::to_string(i);
+}
+
+static void generate_code(std::string &out, rng_state &rng, const options &opt, int lines)
+{
+	int depth = 0;
+
+	// Whether each open condition already has an #else
+	bool hasElse[8];
+
+	for (int i = 0; i < lines; i++) {
+		if (rng.range(100) < opt.density) {
+			if (depth > 0 && rng.range(3) == 0) {
+				// Close or continue the current condition
+				if (!hasElse[depth - 1] && rng.range(2) == 0) {
+					out += "#else\n";
+					hasElse[depth - 1] = true;
+				} else {
+					out += "#endif\n";
+					depth--;
+				}
+			} else if (depth < 8) {
+				// Open a new condition over the definitions, some of which are never defined
+				int a = rng.range(opt.defines * 2);
+				int b = rng.range(opt.defines * 2);
+				switch (rng.range(3)) {
+				case 0: out += "#if " + define_name(a) + "\n"; break;
+				case 1: out += "#if defined(" + define_name(a) + ") && !" + define_name(b) + "\n"; break;
+				case 2: out += "#if " + define_name(a) + " >= " + std::to_string(rng.range(1000)) + "\n"; break;
+				}
+				hasElse[depth++] = false;
+			}
+		}
+
+		switch (rng.range(4)) {
+		case 0: out += "\tint value" + std::to_string(i) + " = GetSomething(\"text\", " + std::to_string(rng.range(1000)) + ");\n"; break;
+		case 1: out += "\t// Some comment about line " + std::to_string(i) + "\n"; break;
+		case 2: out += "\tif (value > 0) { DoSomething(value); }\n"; break;
+		case 3: out += "\n"; break;
+		}
+	}
+
+	while (depth-- > 0) {
+		out += "#endif\n";
+	}
+}
+
+static void generate_includes(std::string &out, rng_state &rng, const options &opt, int maxShared)
+{
+	if (maxShared <= 0) {
+		return;
+	}
+
+	int count = rng.range(opt.fanout + 1);
+	for (int i = 0; i < count; i++) {
+		out += "#include \"shared/shared_" + std::to_string(rng.range(maxShared)) + ".as\"\n";
+	}
+}
+
+static int generate(const std::string &dir, const options &opt)
+{
+	rng_state rng;
+	rng.state = opt.seed ? opt.seed : 1;
+
+	if (!make_dir(dir) || !make_dir(dir + "/shared") || !make_dir(dir + "/plugins")) {
+		fprintf(stderr, "Couldn't create directories in \"%s\"\n", dir.c_str());
+		return 1;
+	}
+
+	// Roughly half of the definitions exist
+	std::string defines;
+	for (int i = 0; i < opt.defines * 2; i += 2) {
+		defines += define_name(i + rng.range(2)) + " " + std::to_string(rng.range(1000)) + "\n";
+	}
+	if (!write_file(dir + "/defines.txt", defines)) {
+		return 1;
+	}
+
+	// Shared includes only include lower numbered shared includes, so there are no cycles
+	for (int i = 0; i < opt.shared; i++) {
+		std::string contents;
+		generate_includes(contents, rng, opt, i);
+		generate_code(contents, rng, opt, opt.lines / 2);
+		if (!write_file(dir + "/shared/shared_" + std::to_string(i) + ".as", contents)) {
+			return 1;
+		}
+	}
+
+	for (int p = 0; p < opt.plugins; p++) {
+		std::string pluginDir = dir + "/plugins/" + std::to_string(p);
+		if (!make_dir(pluginDir)) {
+			fprintf(stderr, "Couldn't create \"%s\"\n", pluginDir.c_str());
+			return 1;
+		}
+
+		for (int f = 0; f < opt.files; f++) {
+			std::string contents;
+			generate_includes(contents, rng, opt, opt.shared);
+			generate_code(contents, rng, opt, opt.lines);
+			if (!write_file(pluginDir + "/script_" + std::to_string(f) + ".as", contents)) {
+				return 1;
+			}
+		}
+	}
+
+	printf("{\"plugins\":%d,\"files\":%d,\"shared\":%d,\"defines\":%d}\n", opt.plugins, opt.plugins * opt.files, opt.shared, opt.defines);
+	return 0;
+}
+
+struct run_state
+{
+	std::string dir;
+	const ccpp::config* config;
+	int readLatency;
+
+	size_t files;
+	size_t includes;
+	size_t bytes;
+
+	// Files included by the current script, which are only included once
+	std::vector<std::string> included;
+};
+
+static void process_buffer(run_state &state, char* buffer, size_t size)
+{
+	// Every file gets its own session on the shared config
+	ccpp::session s(*state.config);
+	s.process(buffer, size);
+
+	state.bytes += size;
+}
+
+static bool process_file(run_state &state, const std::string &path)
+{
+	size_t size;
+	char* buffer = read_file(state.dir + "/" + path, &size, state.readLatency);
+	if (buffer == nullptr) {
+		fprintf(stderr, "Couldn't read \"%s\"\n", path.c_str());
+		return false;
+	}
+
+	process_buffer(state, buffer, size);
+	free(buffer);
+	return true;
+}
+
+static bool load_defines(const std::string &dir, ccpp::config &cfg)
+{
+	size_t size;
+	char* buffer = read_file(dir + "/defines.txt", &size);
+	if (buffer == nullptr) {
+		fprintf(stderr, "Couldn't read \"%s/defines.txt\"\n", dir.c_str());
+		return false;
+	}
+
+	char* line = buffer;
+	while (*line != '\0') {
+		char* lineEnd = strchr(line, '\n');
+		if (lineEnd != nullptr) {
+			*lineEnd = '\0';
+		}
+
+		char* value = strchr(line, ' ');
+		if (value != nullptr) {
+			*value++ = '\0';
+		}
+		if (*line != '\0') {
+			cfg.add_define(line, value);
+		}
+
+		if (lineEnd == nullptr) {
+			break;
+		}
+		line = lineEnd + 1;
+	}
+
+	free(buffer);
+	return true;
+}
+
+static int run(const std::string &dir, const options &opt)
+{
+	std::vector<std::string> scripts;
+
+	// The tree is generated with a known layout, so there is no need to list directories
+	for (int p = 0; ; p++) {
+		std::string pluginDir = "plugins/" + std::to_string(p);
+		int f = 0;
+		for (; ; f++) {
+			std::string path = pluginDir + "/script_" + std::to_string(f) + ".as";
+			FILE* fh = fopen((dir + "/" + path).c_str(), "rb");
+			if (fh == nullptr) {
+				break;
+			}
+			fclose(fh);
+			scripts.push_back(path);
+		}
+		if (f == 0) {
+			break;
+		}
+	}
+
+	if (scripts.size() == 0) {
+		fprintf(stderr, "No scripts found in \"%s\", did you generate it?\n", dir.c_str());
+		return 1;
+	}
+
+	auto setupStart = std::chrono::steady_clock::now();
+
+	ccpp::config cfg;
+	ccpp::snapshot snapshot;
+	std::string snapshotPath = dir + "/state.snap";
+	if (opt.snapshot && snapshot.load(snapshotPath.c_str())) {
+		cfg.set_snapshot(&snapshot);
+	} else if (!load_defines(dir, cfg)) {
+		return 1;
+	}
+
+	double setup = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - setupStart).count();
+
+	run_state state;
+	state.dir = dir;
+	state.config = &cfg;
+	state.readLatency = opt.readLatency;
+	state.files = 0;
+	state.includes = 0;
+	state.bytes = 0;
+
+	auto onInclude = [&state](std::string_view includePath) {
+		if (std::find(state.included.begin(), state.included.end(), includePath) != state.included.end()) {
+			return true;
+		}
+		std::string path(includePath);
+		state.included.push_back(path);
+		state.includes++;
+		return process_file(state, path);
+	};
+
+	// Files are read on other threads, and processed once they're ready
+	auto onIncludeLoad = [&state](std::string_view includePath) {
+		if (std::find(state.included.begin(), state.included.end(), includePath) != state.included.end()) {
+			std::promise<std::optional<std::string>> empty;
+			empty.set_value(std::string());
+			return empty.get_future();
+		}
+		std::string path(includePath);
+		state.included.push_back(path);
+		state.includes++;
+
+		return std::async(std::launch::async, [path = state.dir + "/" + path, latency = state.readLatency]() -> std::optional<std::string> {
+			size_t size;
+			char* buffer = read_file(path, &size, latency);
+			if (buffer == nullptr) {
+				return std::nullopt;
+			}
+			std::string content(buffer, size);
+			free(buffer);
+			return content;
+		});
+	};
+	auto onIncludeReady = [&state](std::string_view, std::string &content) {
+		process_buffer(state, &content[0], content.size());
+		return true;
+	};
+
+	// The prefetcher loads every file, so only the first include of each is processed
+	auto onPrefetchedRead = [&state](std::string_view includePath) -> std::optional<std::string> {
+		size_t size;
+		char* buffer = read_file(state.dir + "/" + std::string(includePath), &size, state.readLatency);
+		if (buffer == nullptr) {
+			return std::nullopt;
+		}
+		std::string content(buffer, size);
+		free(buffer);
+		return content;
+	};
+	auto onPrefetchedReady = [&state](std::string_view includePath, std::string &content) {
+		if (std::find(state.included.begin(), state.included.end(), includePath) != state.included.end()) {
+			return true;
+		}
+		state.included.push_back(std::string(includePath));
+		state.includes++;
+		process_buffer(state, &content[0], content.size());
+		return true;
+	};
+	ccpp::prefetcher prefetcher(onPrefetchedRead);
+	prefetcher.set_snapshot(&snapshot);
+
+	if (opt.prefetch) {
+		cfg.set_include_prefetcher(&prefetcher);
+		cfg.set_async_include_callbacks(nullptr, onPrefetchedReady);
+	} else if (opt.async) {
+		cfg.set_async_include_callbacks(onIncludeLoad, onIncludeReady);
+	} else {
+		cfg.set_include_callback(onInclude);
+	}
+	cfg.freeze();
+
+	std::vector<double> latencies;
+	latencies.reserve(scripts.size() * opt.repeat);
+
+	auto start = std::chrono::steady_clock::now();
+	for (int r = 0; r < opt.repeat; r++) {
+		for (const std::string &path : scripts) {
+			auto fileStart = std::chrono::steady_clock::now();
+			state.included.clear();
+			if (!process_file(state, path)) {
+				return 1;
+			}
+			latencies.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - fileStart).count());
+			state.files++;
+		}
+	}
+	double wall = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+	// Save the state for the next run
+	if (opt.snapshot && !snapshot.is_loaded()) {
+		if (!ccpp::snapshot::save(snapshotPath.c_str(), cfg, opt.prefetch ? &prefetcher : nullptr)) {
+			fprintf(stderr, "Couldn't write \"%s\"\n", snapshotPath.c_str());
+		}
+	}
+
+	std::sort(latencies.begin(), latencies.end());
+	auto percentile = [&latencies](double p) {
+		size_t index = (size_t)(p * (latencies.size() - 1) + 0.5);
+		return latencies[index];
+	};
+
+	printf("{\"files\":%zu,\"includes\":%zu,\"bytes\":%zu,\"setup_ms\":%.3f,\"wall_ms\":%.3f,\"peak_rss_kb\":%zu,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f}}\n",
+		state.files,
+		state.includes,
+		state.bytes,
+		setup,
+		wall,
+		peak_rss_kb(),
+		percentile(0.5),
+		percentile(0.9),
+		percentile(0.99),
+		latencies.back()
+	);
+	return 0;
+}
+
+static void usage()
+{
+	fprintf(stderr, "Usage:\n");
+	fprintf(stderr, "  ccpp_corpus generate <dir> [--plugins N] [--files N] [--shared N] [--fanout N] [--density PERCENT] [--defines N] [--lines N] [--seed N]\n");
+	fprintf(stderr, "  ccpp_corpus run <dir> [--repeat N] [--async 0|1] [--prefetch 0|1] [--snapshot 0|1] [--read-latency MICROSECONDS]\n");
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 3) {
+		usage();
+		return 1;
+	}
+
+	options opt;
+	for (int i = 3; i < argc; i++) {
+		if (i + 1 >= argc) {
+			usage();
+			return 1;
+		}
+
+		const char* arg = argv[i];
+		int value = atoi(argv[++i]);
+
+		if (!strcmp(arg, "--plugins")) { opt.plugins = value; }
+		else if (!strcmp(arg, "--files")) { opt.files = value; }
+		else if (!strcmp(arg, "--shared")) { opt.shared = value; }
+		else if (!strcmp(arg, "--fanout")) { opt.fanout = value; }
+		else if (!strcmp(arg, "--density")) { opt.density = value; }
+		else if (!strcmp(arg, "--defines")) { opt.defines = value; }
+		else if (!strcmp(arg, "--lines")) { opt.lines = value; }
+		else if (!strcmp(arg, "--seed")) { opt.seed = (uint32_t)value; }
+		else if (!strcmp(arg, "--repeat")) { opt.repeat = value; }
+		else if (!strcmp(arg, "--async")) { opt.async = value; }
+		else if (!strcmp(arg, "--prefetch")) { opt.prefetch = value; }
+		else if (!strcmp(arg, "--snapshot")) { opt.snapshot = value; }
+		else if (!strcmp(arg, "--read-latency")) { opt.readLatency = value; }
+		else {
+			usage();
+			return 1;
+		}
+	}
+
+	if (opt.defines < 1) {
+		opt.defines = 1;
+	}
+
+	if (!strcmp(argv[1], "generate")) {
+		return generate(argv[2], opt);
+	} else if (!strcmp(argv[1], "run")) {
+		return run(argv[2], opt);
+	}
+
+	usage();
+	return 1;
+}
@@ -35,13 +35,19 @@
  *   }
  *
  * Supported directives:
- *   #define <word>
+ *   #define <word> [value]
  *   #undef <word>
  *   #if <condition>
  *   #else
  *   #elif <condition>
  *   #endif
  *
+ * Conditions are integer constant expressions evaluated over 64 bit integers,
+ * much like in C. They may contain integer literals, defined(<word>) or
+ * defined <word>, and the usual arithmetic, bitwise, comparison and logical
+ * operators. A word evaluates to the value of its definition, to 1 if it's
+ * defined without a value, or to 0 if it's not defined at all.
+ *
  *
  * MIT License
  *
@@ -69,799 +75,5011 @@
 #pragma once
 
 #include <vector>
-#include <stack>
-#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <future>
+#include <optional>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <type_traits>
+#include <memory>
 #include <cstdint>
 
+// Scopes that fit in the processor itself before the scope stack moves to the heap
+#ifndef CCPP_INLINE_SCOPES
+#  define CCPP_INLINE_SCOPES 64
+#endif
+
+// Asynchronous includes that can be loading at once before process() waits for them
+#ifndef CCPP_MAX_PENDING_INCLUDES
+#  define CCPP_MAX_PENDING_INCLUDES 64
+#endif
+
 namespace ccpp
 {
 	extern char character;
 
-	class processor
-	{
-		typedef std::function<bool(const char* path)> include_callback_t;
-		typedef std::function<bool(const char* command, const char* value)> command_callback_t;
+	template<typename TSignature>
+	class function_ref;
 
+	// Non-owning reference to a function or callable object, which is called without any allocation or
+	// type erasure beyond a single indirect call. Only lvalues are accepted, so the referenced callable
+	// can't be a temporary, and it must outlive any use of the reference.
+	template<typename TRet, typename... TArgs>
+	class function_ref<TRet(TArgs...)>
+	{
 	private:
-		char* m_p;
-		char* m_pEnd;
-
-		size_t m_line;
-		size_t m_column;
-
-		std::vector<const char*> m_defines;
-		std::stack<uint32_t> m_stack;
-
-		include_callback_t m_includeCallback;
-		command_callback_t m_commandCallback;
+		union
+		{
+			void* m_object;
+			TRet(*m_function)(TArgs...);
+		};
+		TRet(*m_invoke)(const function_ref &ref, TArgs... args);
 
 	public:
-		processor();
-		processor(const processor &copy);
-		~processor();
+		function_ref()
+			: m_object(nullptr), m_invoke(nullptr)
+		{
+		}
 
-		void add_define(const char* name);
-		void remove_define(const char* name);
+		function_ref(std::nullptr_t)
+			: function_ref()
+		{
+		}
+
+		function_ref(TRet(*function)(TArgs...))
+			: m_function(function), m_invoke(function != nullptr ? &invoke_function : nullptr)
+		{
+		}
 
-		bool has_define(const char* name);
+		template<typename TCallable, typename = typename std::enable_if<!std::is_same<typename std::remove_const<TCallable>::type, function_ref>::value>::type>
+		function_ref(TCallable &callable)
+			: m_object((void*)std::addressof(callable)), m_invoke(&invoke_object<TCallable>)
+		{
+		}
 
-		void set_include_callback(const include_callback_t &callback);
-		void set_command_callback(const command_callback_t &callback);
+		TRet operator()(TArgs... args) const
+		{
+			return m_invoke(*this, std::forward<TArgs>(args)...);
+		}
 
-		void process(char* buffer);
-		void process(char* buffer, size_t len);
+		explicit operator bool() const
+		{
+			return m_invoke != nullptr;
+		}
 
 	private:
-		bool test_condition();
-
-		void expect_eol();
-		void consume_line();
+		static TRet invoke_function(const function_ref &ref, TArgs... args)
+		{
+			return ref.m_function(std::forward<TArgs>(args)...);
+		}
 
-		void overwrite(char* p, size_t len);
+		template<typename TCallable>
+		static TRet invoke_object(const function_ref &ref, TArgs... args)
+		{
+			return (*(TCallable*)ref.m_object)(std::forward<TArgs>(args)...);
+		}
 	};
-}
-
-#if defined(CCPP_IMPL)
 
-#include <string>
-#include <cstring>
-#include <malloc.h>
+	// Interface for routing every allocation the library makes, eg. to an arena or a memory budget.
+	// Returned memory must be suitably aligned for any type, like malloc.
+	class allocator
+	{
+	public:
+		virtual ~allocator() { }
 
-#ifndef CCPP_ERROR
-#  define CCPP_ERROR(error, ...) printf("[CCPP ERROR] " error "\n", ##__VA_ARGS__)
-#endif
+		virtual void* allocate(size_t size) = 0;
+		virtual void deallocate(void* p, size_t size) = 0;
+	};
 
-#ifndef CCPP_ASSERT
-#  if defined(_DEBUG)
-#    define CCPP_ASSERT(cond) if (!(cond)) { CCPP_ERROR("Assertion failed: '%s' on line %d", #cond, __LINE__); }
-#  else
-#    define CCPP_ASSERT(cond)
-#  endif
-#endif
+	// The allocator that is used when none is given, which uses malloc and free
+	allocator* default_allocator();
 
-enum class ELexType
-{
-	None,
+	// Adapts an allocator for use in standard containers
+	template<typename T>
+	class stl_allocator
+	{
+	public:
+		typedef T value_type;
 
-	Whitespace,
-	Newline,
-	Word,
-	Operator,
-	String,
-};
+		allocator* m_allocator;
 
-static const char* lex_type_name(ELexType type)
-{
-	switch (type) {
-	case ELexType::Whitespace: return "WHITESPACE";
-	case ELexType::Newline: return "NEWLINE";
-	case ELexType::Word: return "WORD";
-	case ELexType::Operator: return "OPERATOR";
-	case ELexType::String: return "STRING";
-	}
-	return "NONE";
-}
+		stl_allocator(allocator* alloc)
+			: m_allocator(alloc)
+		{
+		}
 
-static void lex_char_text(char c, char* buffer, size_t size)
-{
-	if (isalnum(c)) {
-		snprintf(buffer, size, "%c", c);
-		return;
-	}
-	snprintf(buffer, size, "\\x%02X", (int)c);
-}
+		template<typename U>
+		stl_allocator(const stl_allocator<U> &other)
+			: m_allocator(other.m_allocator)
+		{
+		}
 
-static size_t lex(char* p, char* pEnd, ELexType &type)
-{
-	type = ELexType::None;
+		T* allocate(size_t n)
+		{
+			return (T*)m_allocator->allocate(n * sizeof(T));
+		}
 
-	char* pStart = p;
+		void deallocate(T* p, size_t n)
+		{
+			m_allocator->deallocate(p, n * sizeof(T));
+		}
 
-	if (*p == '"') {
-		type = ELexType::String;
+		template<typename U>
+		bool operator==(const stl_allocator<U> &other) const
+		{
+			return m_allocator == other.m_allocator;
+		}
 
-		while (p < pEnd) {
-			p++;
-			if (*p == '\\') {
-				// Skip next character
-				p++;
-			} else if (*p == '"') {
-				// End of string
-				p++;
-				break;
-			}
+		template<typename U>
+		bool operator!=(const stl_allocator<U> &other) const
+		{
+			return m_allocator != other.m_allocator;
 		}
+	};
 
-	} else {
-		bool haveNewlineR = false;
-		bool haveNewlineN = false;
+	enum directive_kind
+	{
+		directive_define,
+		directive_undef,
+		directive_if,
+		directive_elif,
+		directive_else,
+		directive_endif,
+		directive_include,
+
+		// Any other directive, handled by the command callback
+		directive_command,
+
+		directive_count,
+	};
 
-		while (p < pEnd) {
-			char c = *p;
-			bool isWhitespace = (c == ' ' || c == '\t');
-			bool isNewline = (c == '\r' || c == '\n');
-			bool isAlphaNum = ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_');
-			bool isOperator = (c == '!' || c == '&' || c == '|' || c == '(' || c == ')');
-
-			if (isNewline) {
-				// Only handle 1 newline at a time, which can be any combination of \r and \n
-				if (c == '\r') {
-					if (haveNewlineR) break;
-					haveNewlineR = true;
-				}
-				if (c == '\n') {
-					if (haveNewlineN) break;
-					haveNewlineN = true;
-				}
-			}
+	enum class output_mode
+	{
+		// Erased content and directives are replaced by spaces, keeping the buffer the same size
+		in_place,
 
-			if (type == ELexType::None) {
-				if (isWhitespace) {
-					type = ELexType::Whitespace;
-				} else if (isNewline) {
-					type = ELexType::Newline;
-				} else if (isAlphaNum) {
-					type = ELexType::Word;
-				} else if (isOperator) {
-					type = ELexType::Operator;
-				}
+		// Erased lines and directive lines are removed from the buffer entirely
+		compact,
 
-			} else {
-				if (type == ELexType::Whitespace && !isWhitespace) {
-					break;
-				} else if (type == ELexType::Newline && !isNewline) {
-					break;
-				} else if (type == ELexType::Word && !isAlphaNum) {
-					break;
-				} else if (type == ELexType::Operator && !isOperator) {
-					break;
-				}
-			}
+		// Like compact, but also collapses runs of whitespace and drops blank lines. Comments and
+		// strings are recognized as if language aware, and strings are left untouched.
+		minify,
+	};
 
-			p++;
-		}
-	}
+	// Maps lines of preprocessed output back to the file and line they came from. Only
+	// the points where the mapping stops being contiguous are stored, as runs.
+	class line_map
+	{
+	public:
+		struct location
+		{
+			uint32_t file;
+			uint32_t line;
+		};
 
-	return p - pStart;
-}
+	private:
+		struct run
+		{
+			uint32_t output_line;
+			uint32_t file;
+			uint32_t source_line;
+		};
 
-static size_t lex_expect(char* p, char* pEnd, ELexType expected_type)
-{
-	ELexType type;
-	size_t len = lex(p, pEnd, type);
+		std::vector<run, stl_allocator<run>> m_runs;
+		uint32_t m_outputLine;
 
-	if (type != expected_type) {
-		char buffer[16];
-		lex_char_text(*p, buffer, sizeof(buffer));
-		CCPP_ERROR("Unexpected '%s' of type %s, was expecting a %s", buffer, lex_type_name(type), lex_type_name(expected_type));
-		return 0;
-	}
+	public:
+		line_map(allocator* alloc = nullptr);
 
-	return len;
-}
+		void clear();
 
-// Same as lex(), except skips whitespace and outputs start and length of the symbol
-static size_t lex_next(char* p, char* pEnd, ELexType &type, char** start, size_t* len)
-{
-	ELexType t;
-	size_t l = lex(p, pEnd, t);
-	*len = l;
+		// Marks that the current output line comes from the given file and line
+		void mark(uint32_t file, uint32_t source_line);
+		// Moves the current output line forward
+		void advance(uint32_t lines);
 
-	if (t == ELexType::Whitespace) {
-		p += l;
-		size_t l2 = lex(p, pEnd, t);
-		*len = l2;
-		l += l2;
-	}
+		uint32_t output_line() const;
+		size_t run_count() const;
 
-	type = t;
-	*start = p;
-	return l;
-}
+		bool lookup(uint32_t output_line, location &out) const;
+	};
 
-char ccpp::character = '#';
+	// Records timestamped begin and end events, which can be exported as Chrome trace event JSON
+	class tracer
+	{
+	private:
+		struct event
+		{
+			uint64_t time;
+			uint32_t name;
+			uint32_t detail;
+			bool begin;
+		};
+
+		std::vector<event, stl_allocator<event>> m_events;
+		std::basic_string<char, std::char_traits<char>, stl_allocator<char>> m_strings;
+		uint64_t m_start;
 
-enum
-{
-	// Contents must pass
-	Scope_Passing = (1 << 0),
+	public:
+		tracer(allocator* alloc = nullptr);
 
-	// Contents must be erased
-	Scope_Erasing = (1 << 1),
+		void clear();
 
-	// Contents are inside of an else directive
-	Scope_Else = (1 << 2),
+		void begin(const char* name, const char* detail = nullptr);
+		void begin(const char* name, const char* detail, size_t lenDetail);
+		void end();
 
-	// Contents are inside of an else if directive
-	Scope_ElseIf = (1 << 3),
+		size_t event_count() const;
 
-	// Contents are deep and should be ignored
-	Scope_Deep = (1 << 4),
-};
+		void write_json(std::string &out) const;
+		bool save_json(const char* path) const;
 
-enum
-{
-	// The match passed
-	Match_Pass = (1 << 0),
+	private:
+		uint32_t add_string(const char* str, size_t len);
 
-	// Should be matched as AND with previous entry
-	Match_OpAnd = (1 << 1),
+		template<typename TString>
+		void write_json_to(TString &out) const;
+	};
 
-	// Should be matched as OR with previous entry
-	Match_OpOr = (1 << 2),
-};
+	// Include paths found by session::scan_dependencies, each listed once in the order they were found
+	class dependencies
+	{
+	private:
+		typedef std::basic_string<char, std::char_traits<char>, stl_allocator<char>> path_string;
 
-ccpp::processor::processor()
-{
-	m_p = nullptr;
-	m_pEnd = nullptr;
-}
+		std::deque<path_string, stl_allocator<path_string>> m_paths;
+		std::unordered_set<std::string_view, std::hash<std::string_view>, std::equal_to<std::string_view>, stl_allocator<std::string_view>> m_known;
 
-ccpp::processor::processor(const processor &copy)
-	: processor()
-{
-	for (const char* p : copy.m_defines) {
-		add_define(p);
-	}
+	public:
+		dependencies(allocator* alloc = nullptr);
 
-	m_includeCallback = copy.m_includeCallback;
-	m_commandCallback = copy.m_commandCallback;
-}
+		void clear();
 
-ccpp::processor::~processor()
-{
-	for (const char* p : m_defines) {
-		free((void*)p);
-	}
-}
+		// Returns false if the path was already listed
+		bool add(std::string_view path);
 
-void ccpp::processor::add_define(const char* name)
-{
-	if (has_define(name)) {
-		CCPP_ERROR("Definition \"%s\" already exists!", name);
-		return;
-	}
+		size_t size() const;
+		std::string_view operator[](size_t index) const;
 
-	size_t len = strlen(name);
-	char* p = (char*)malloc(len + 1);
-	memcpy(p, name, len + 1);
+		// Writes the paths as a Makefile rule for the given target, like gcc -M
+		void write_depfile(std::string &out, std::string_view target) const;
+		bool save_depfile(const char* path, std::string_view target) const;
 
-	m_defines.emplace_back(p);
-}
+	private:
+		template<typename TString>
+		void write_depfile_to(TString &out, std::string_view target) const;
+	};
 
-void ccpp::processor::remove_define(const char* name)
-{
-	for (size_t i = 0; i < m_defines.size(); i++) {
-		if (!strcmp(m_defines[i], name)) {
-			m_defines.erase(m_defines.begin() + i);
-			return;
-		}
-	}
+	// A directive found by directive_list, with offsets into the buffer it was found in
+	struct directive_record
+	{
+		directive_kind kind;
+		uint32_t line;
 
-	CCPP_ERROR("Couldn't undefine \"%s\" because it does not exist!", name);
-}
+		// The whole directive, from the directive character up to the end of the line
+		uint32_t offset;
+		uint32_t length;
 
-bool ccpp::processor::has_define(const char* name)
-{
-	for (const char* p : m_defines) {
-		if (!strcmp(p, name)) {
-			return true;
-		}
-	}
-	return false;
-}
+		// The directive word, eg. "if"
+		uint32_t name;
+		uint32_t lenName;
 
-void ccpp::processor::set_include_callback(const include_callback_t &callback)
-{
-	m_includeCallback = callback;
-}
+		// Everything after the directive word, eg. the condition or path, without surrounding whitespace
+		uint32_t argument;
+		uint32_t lenArgument;
+	};
 
-void ccpp::processor::set_command_callback(const command_callback_t &callback)
-{
-	m_commandCallback = callback;
-}
+	// Lists the directives in a buffer without processing it. Nothing is evaluated, so directives
+	// inside of conditions that don't pass are listed as well.
+	class directive_list
+	{
+	private:
+		std::vector<directive_record, stl_allocator<directive_record>> m_directives;
 
-void ccpp::processor::process(char* buffer)
-{
-	process(buffer, strlen(buffer));
-}
+	public:
+		directive_list(allocator* alloc = nullptr);
 
-void ccpp::processor::process(char* buffer, size_t len)
-{
-	if (m_p != nullptr) {
-		CCPP_ERROR("Illegal attempt of preprocessor usage while not finished preprocessing!");
-		return;
-	}
+		// Finds every directive in the buffer, replacing the ones that were found before
+		void find(const char* buffer, size_t len);
+		void clear();
 
-	m_line = 1;
-	m_column = 0;
+		size_t size() const;
+		const directive_record &operator[](size_t index) const;
+		const directive_record* begin() const;
+		const directive_record* end() const;
+	};
 
-	m_p = buffer;
-	m_pEnd = buffer + len;
+	// Streaming 64 bit hash (XXH64), which gives the same result for the same bytes no matter how
+	// they're split up between calls to update()
+	class hasher
+	{
+	private:
+		uint64_t m_seed;
+		uint64_t m_acc[4];
+		uint8_t m_buffer[32];
+		size_t m_buffered;
+		uint64_t m_total;
 
-	while (m_p < m_pEnd) {
-		bool isErasing = false;
-		bool isDeep = false;
+	public:
+		hasher(uint64_t seed = 0);
 
-		if (m_stack.size() > 0) {
-			const uint32_t &scope = m_stack.top();
+		void reset(uint64_t seed = 0);
+		void update(const void* data, size_t len);
+		void update(std::string_view data);
+		uint64_t digest() const;
 
-			isErasing = (scope & Scope_Erasing);
-			isDeep = (scope & Scope_Deep);
-		}
+		static uint64_t hash(const void* data, size_t len, uint64_t seed = 0);
+	};
 
-		if (*m_p == '\n') {
-			m_column = 0;
-			m_line++;
-			m_p++;
-		} else {
-			if (m_column++ > 0 || *m_p != character) {
-				if (isErasing) {
-					*m_p = ' ';
-				}
+	class config;
+	class prefetcher;
 
-				m_p++;
-				continue;
-			}
+	// Definitions and loaded includes saved to a file, which is mapped into memory when it's loaded and
+	// used as it is. Everything is stored at offsets from the start of the file, and both are stored as
+	// hash tables, so nothing has to be rebuilt or allocated to use them.
+	class snapshot
+	{
+		friend class config;
 
-			char* commandStart = m_p++;
+	public:
+		// Snapshots written by another version can't be loaded
+		static const uint32_t version = 1;
 
-			// Expect a command word
-			size_t lenCommand = lex_expect(m_p, m_pEnd, ELexType::Word);
-			if (lenCommand == 0) {
-				continue;
-			}
+	private:
+		struct header
+		{
+			char magic[4];
+			uint32_t version;
+			uint32_t byte_order;
+			uint32_t entry_size;
+			uint64_t size;
+
+			uint64_t define_count;
+			uint64_t define_buckets;
+			uint64_t define_table;
+
+			uint64_t file_count;
+			uint64_t file_buckets;
+			uint64_t file_table;
+		};
+
+		// A name and value, or a path and contents, stored one after the other and NUL-terminated. An
+		// offset of 0 is an empty bucket.
+		struct entry
+		{
+			uint64_t hash;
+			uint64_t offset;
+			uint64_t key_size;
+			uint64_t value_size;
+		};
+
+		const char* m_data;
+		size_t m_size;
+		bool m_mapped;
+
+		const entry* m_defines;
+		size_t m_defineCount;
+		size_t m_defineBuckets;
+
+		const entry* m_files;
+		size_t m_fileCount;
+		size_t m_fileBuckets;
 
-			char* wordCommand = (char*)alloca(lenCommand + 1);
-			memcpy(wordCommand, m_p, lenCommand);
-			wordCommand[lenCommand] = '\0';
+	public:
+		snapshot();
+		snapshot(const snapshot &copy) = delete;
+		~snapshot();
 
-			m_p += lenCommand;
+		// Writes the definitions of the config, and the files loaded by the prefetcher if one is given,
+		// after waiting for the ones that are still loading
+		static void write(std::string &out, const config &cfg, prefetcher* files = nullptr);
+		static bool save(const char* path, const config &cfg, prefetcher* files = nullptr);
 
-			if (!strcmp(wordCommand, "define")) {
-				// #define <word>
+		// Maps the file into memory. Returns false if it can't be read or isn't a snapshot of this version.
+		bool load(const char* path);
+		// Uses a snapshot that is already in memory, which must stay there until the snapshot is closed
+		bool load(const void* data, size_t size);
+		void close();
 
-				if (isErasing) {
-					// Just consume the line if we're erasing
-					consume_line();
+		bool is_loaded() const;
 
-				} else {
-					// Expect some whitespace
-					size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
-					if (lenCommandWhitespace == 0) {
-						continue;
-					}
-					m_p += lenCommandWhitespace;
+		size_t define_count() const;
+		// Returns the value of the definition, which is empty if it has no value, or nullptr if it's not in the snapshot
+		const char* get_define(std::string_view name) const;
 
-					// Expect a define word
-					size_t lenDefine = lex_expect(m_p, m_pEnd, ELexType::Word);
-					if (lenDefine == 0) {
-						continue;
-					}
+		size_t file_count() const;
+		bool get_file(std::string_view path, std::string_view &content) const;
 
-					char* wordDefine = (char*)alloca(lenDefine + 1);
-					memcpy(wordDefine, m_p, lenDefine);
-					wordDefine[lenDefine] = '\0';
+	private:
+		const entry* find(const entry* table, size_t buckets, std::string_view key) const;
 
-					m_p += lenDefine;
+		template<typename TString>
+		static void write_to(TString &out, const config &cfg, prefetcher* files);
+	};
 
-					// Add define
-					add_define(wordDefine);
+	// Keeps processed output in a directory on disk, so files that haven't changed don't have to be
+	// processed again. Entries are written to a temporary file first and renamed into place, so they're
+	// never seen half written, and they're mapped into memory when they're read.
+	class cache
+	{
+	public:
+		// Bumped whenever process() produces different output, so output cached by older versions isn't used
+		static const uint32_t version = 1;
 
-					// Expect end of line
-					expect_eol();
-				}
+		// Cached output, which stays mapped into memory until the view is destroyed
+		class view
+		{
+			friend class cache;
 
-			} else if (!strcmp(wordCommand, "undef")) {
-				// #undef <word>
+		private:
+			const char* m_data;
+			size_t m_size;
 
-				if (isErasing) {
-					// Just consume the line if we're erasing
-					consume_line();
+		public:
+			view();
+			view(view &&move);
+			view(const view &copy) = delete;
+			~view();
 
-				} else {
-					// Expect some whitespace
-					size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
-					if (lenCommandWhitespace == 0) {
-						continue;
-					}
-					m_p += lenCommandWhitespace;
+			view &operator=(view &&move);
 
-					// Expect a define word
-					size_t lenDefine = lex_expect(m_p, m_pEnd, ELexType::Word);
-					if (lenDefine == 0) {
-						continue;
-					}
+			const char* data() const;
+			size_t size() const;
 
-					char* wordDefine = (char*)alloca(lenDefine + 1);
-					memcpy(wordDefine, m_p, lenDefine);
-					wordDefine[lenDefine] = '\0';
+		private:
+			void close();
+		};
 
-					m_p += lenDefine;
+	private:
+		typedef std::basic_string<char, std::char_traits<char>, stl_allocator<char>> path_string;
+
+		struct file_header
+		{
+			char magic[4];
+			uint32_t version;
+			uint64_t key;
+			uint64_t size;
+		};
+
+		struct entry
+		{
+			uint64_t size;
+			uint64_t last_use;
+		};
+
+		path_string m_dir;
+		uint64_t m_maxSize;
+
+		// Entries in the directory by key, which are evicted by their last use once there's too much
+		std::mutex m_mutex;
+		std::unordered_map<uint64_t, entry, std::hash<uint64_t>, std::equal_to<uint64_t>, stl_allocator<std::pair<const uint64_t, entry>>> m_entries;
+		uint64_t m_size;
+		uint64_t m_tempCounter;
 
-					// Undefine
-					remove_define(wordDefine);
+	public:
+		// Creates the directory if needed. Keeps at most maxSize bytes in it, or any amount if maxSize is 0.
+		cache(const char* dir, uint64_t maxSize = 0, allocator* alloc = nullptr);
+		cache(const cache &copy) = delete;
+
+		// The key of a buffer that is processed with a config of the given fingerprint
+		static uint64_t key(const char* buffer, size_t len, uint64_t fingerprint);
+
+		// Returns false if there is no output for the key
+		bool get(uint64_t key, view &out);
+		bool put(uint64_t key, const char* output, size_t len);
+
+		// Removes every entry
+		void clear();
+
+		// The total size of the entries in bytes
+		uint64_t size();
+
+	private:
+		path_string entry_path(uint64_t key) const;
+		void evict();
+	};
+
+	// Loads included files on a pool of threads ahead of time. Files given to prefetch() are scanned
+	// for includes without looking at conditions, and every file that is loaded is scanned the same
+	// way, so the whole tree of includes starts loading right away. Loaded files are kept until clear().
+	class prefetcher
+	{
+		friend class snapshot;
+
+	public:
+		// Reads a file, which is called from the pool threads
+		typedef function_ref<std::optional<std::string>(std::string_view path)> read_callback_t;
+
+	private:
+		typedef std::basic_string<char, std::char_traits<char>, stl_allocator<char>> path_string;
+		typedef std::promise<std::optional<std::string>> content_promise;
+		typedef std::shared_future<std::optional<std::string>> content_future;
+
+		struct job
+		{
+			std::string_view path;
+			content_promise content;
+		};
+
+		allocator* m_allocator;
+
+		read_callback_t m_read;
+		const snapshot* m_snapshot;
+
+		std::mutex m_mutex;
+		std::condition_variable m_wake;
+		std::condition_variable m_idle;
+		bool m_stopping;
+		size_t m_reading;
+
+		// Paths are stored here, so they don't move while the files are referred to by them
+		std::deque<path_string, stl_allocator<path_string>> m_paths;
+		std::unordered_map<std::string_view, content_future, std::hash<std::string_view>, std::equal_to<std::string_view>, stl_allocator<std::pair<const std::string_view, content_future>>> m_files;
+		std::deque<job, stl_allocator<job>> m_jobs;
+
+		std::vector<std::thread, stl_allocator<std::thread>> m_threads;
+
+	public:
+		// Uses as many threads as there are cores if threads is 0
+		prefetcher(read_callback_t read, size_t threads = 0, allocator* alloc = nullptr);
+		prefetcher(const prefetcher &copy) = delete;
+		~prefetcher();
+
+		// Starts loading every file the buffer includes, and every file those include
+		void prefetch(const char* buffer, size_t len);
+
+		// Returns the contents of the file, which is loaded first if it wasn't prefetched. Fits the
+		// load callback of config::set_async_include_callbacks.
+		std::future<std::optional<std::string>> load(std::string_view path);
+
+		// Forgets all loaded files, after waiting for the ones that are still loading
+		void clear();
+
+		// Files stored in the snapshot are taken from it instead of being read. The snapshot must
+		// outlive the prefetcher, or be replaced before it's closed. Replacing it waits for the files
+		// that are being loaded.
+		void set_snapshot(const snapshot* snapshot);
+
+	private:
+		void queue(std::string_view path, bool urgent);
+		void run();
+	};
+
+	// Definitions, callbacks and options that can be shared by many sessions. A config must not be
+	// changed while sessions are using it, and after freeze() it can't be changed at all.
+	class config
+	{
+		friend class session;
+		friend class snapshot;
+
+	public:
+		// Callbacks receive views into the buffer being processed, which are only valid during the call
+		typedef function_ref<bool(std::string_view path)> include_callback_t;
+		typedef function_ref<bool(std::string_view command, std::string_view value)> command_callback_t;
+
+		// Starts loading an included file, returning a future for its contents, or for nullopt if it can't be found
+		typedef function_ref<std::future<std::optional<std::string>>(std::string_view path)> include_load_callback_t;
+		// Receives the loaded contents of an included file, in the same order as the includes
+		typedef function_ref<bool(std::string_view path, std::string &content)> include_ready_callback_t;
+
+	private:
+		allocator* m_allocator;
+
+		// Definition values by name, where the name and value share one allocation. Values are
+		// NUL-terminated and empty for definitions without a value. Removed definitions of the
+		// snapshot are kept with a nullptr value, and their name points into the snapshot.
+		typedef std::pair<const std::string_view, const char*> define;
+		std::unordered_map<std::string_view, const char*, std::hash<std::string_view>, std::equal_to<std::string_view>, stl_allocator<define>> m_defines;
+
+		// Definitions that are looked up when they're not in m_defines
+		const snapshot* m_snapshot;
+
+		bool m_frozen;
+
+		bool m_languageAware;
+		output_mode m_outputMode;
+		bool m_stripComments;
+
+		include_callback_t m_includeCallback;
+		command_callback_t m_commandCallback;
+
+		include_load_callback_t m_includeLoadCallback;
+		include_ready_callback_t m_includeReadyCallback;
+
+		prefetcher* m_prefetcher;
+
+	public:
+		config(allocator* alloc = nullptr);
+		config(const config &copy);
+		~config();
+
+		// Makes any further changes an error, so the config can safely be shared between threads
+		void freeze();
+		bool is_frozen() const;
+
+		allocator* get_allocator() const;
+
+		// A hash of every definition and of the options that change the output, for use as a cache key.
+		// This goes over every definition, so keep it instead of asking for it for every file.
+		uint64_t fingerprint() const;
+
+		void add_define(const char* name, const char* value = nullptr);
+		void add_define(std::string_view name, std::string_view value = std::string_view());
+		void remove_define(const char* name);
+		void remove_define(std::string_view name);
+
+		bool has_define(const char* name) const;
+		bool has_define(std::string_view name) const;
+		// Returns the value of the definition, which is empty if it has no value, or nullptr if it's not defined
+		const char* get_define(const char* name) const;
+		const char* get_define(std::string_view name) const;
+
+		// The callbacks are not copied, so they must outlive the config (or be replaced before they're gone)
+		void set_include_callback(include_callback_t callback);
+		void set_command_callback(command_callback_t callback);
+
+		// Includes are loaded in the background while processing goes on, and are handed to the ready
+		// callback in order once process() needs them to be done. Used instead of the include callback.
+		void set_async_include_callbacks(include_load_callback_t load, include_ready_callback_t ready);
+		// Prefetches the includes of every buffer before it's processed, and loads includes through
+		// the prefetcher instead of the load callback
+		void set_include_prefetcher(prefetcher* prefetcher);
+
+		// Uses the definitions of the snapshot as if they were added to the config, without copying
+		// them. The snapshot must outlive the config.
+		void set_snapshot(const snapshot* snapshot);
+
+		// When enabled, comments and strings are skipped over as a whole, so directive characters inside of them are ignored
+		void set_language_aware(bool enabled);
+
+		void set_output_mode(output_mode mode);
+		// Removes comments from the output in minify mode
+		void set_strip_comments(bool strip);
+
+	private:
+		bool can_change();
+
+		define make_define(std::string_view name, std::string_view value) const;
+		void free_define(const define &def) const;
+
+		// Returns the stored name of a definition, given its value
+		static std::string_view define_name(const char* value, size_t lenName);
+	};
+
+	// The state of processing with a config. Definitions made by a session are kept in an overlay on
+	// top of the config, so sessions are cheap to create and don't allocate until something is defined.
+	class session
+	{
+		friend class processor;
+
+	public:
+		// Counters of a single process() run, which are only filled when CCPP_STATS is defined
+		struct stats
+		{
+			uint64_t bytes_scanned;
+			uint64_t bytes_passed;
+			uint64_t bytes_erased;
+			uint64_t bytes_directives;
+
+			uint64_t directives[directive_count];
+			uint64_t condition_evaluations;
+			uint64_t max_scope_depth;
+
+			uint64_t include_count;
+			uint64_t include_time_ns;
+
+			uint64_t command_count;
+			uint64_t command_time_ns;
+
+			// 1 if the buffer had no directives, so processing was skipped
+			uint64_t no_directives;
+		};
+
+	private:
+		// Stack of Scope_ flags, which is stored inline up to CCPP_INLINE_SCOPES deep
+		class scope_stack
+		{
+		private:
+			allocator* m_allocator;
+			uint8_t* m_scopes;
+			size_t m_size;
+			size_t m_capacity;
+			uint8_t m_inline[CCPP_INLINE_SCOPES];
+
+		public:
+			scope_stack(allocator* alloc);
+			scope_stack(const scope_stack &copy) = delete;
+			~scope_stack();
+
+			size_t size() const { return m_size; }
+			// The flags of the innermost scope, or 0 if there is none
+			uint8_t top() const { return m_size > 0 ? m_scopes[m_size - 1] : 0; }
+
+			void push(uint8_t scope);
+			void pop();
+			void set_top(uint8_t scope);
+
+		private:
+			void grow();
+		};
+
+		const config* m_config;
+		allocator* m_allocator;
+
+		// Definitions made or removed by this session. Removed definitions of the config are kept
+		// with a nullptr value, and their name points into the config or its snapshot.
+		typedef config::define define;
+		std::unordered_map<std::string_view, const char*, std::hash<std::string_view>, std::equal_to<std::string_view>, stl_allocator<define>> m_defines;
+
+		char* m_p;
+		char* m_pEnd;
+
+		// Lines are counted only when one is needed, from the last position that was asked for
+		const char* m_lineAt;
+		size_t m_line;
+
+		scope_stack m_stack;
+
+		// Options of the config, kept here during process()
+		bool m_languageAware;
+		output_mode m_outputMode;
+		bool m_stripComments;
+
+		char* m_out;
+		char* m_keep;
+
+		size_t m_minifyLine;
+		bool m_minifyContent;
+		bool m_minifySpace;
+
+		line_map* m_lineMap;
+		uint32_t m_lineMapFile;
+		size_t m_lineMapLine;
+
+		stats* m_stats;
+		tracer* m_tracer;
+
+		// Output up to m_hashed has been fed to the hasher
+		hasher* m_outputHasher;
+		const char* m_hashed;
+
+		// Set while scanning for dependencies, which leaves the buffer alone
+		dependencies* m_dependencies;
+
+		// Parts to erase, which process_parallel() collects before erasing them on multiple threads
+		struct erased_part
+		{
+			char* p;
+			char* pEnd;
+		};
+		std::vector<erased_part, stl_allocator<erased_part>> m_erased;
+		bool m_recordErased;
+
+		struct pending_include
+		{
+			size_t path;
+			size_t lenPath;
+			size_t line;
+			std::future<std::optional<std::string>> content;
+		};
+
+		// Asynchronous includes that are still loading, with their paths in one buffer
+		std::vector<pending_include, stl_allocator<pending_include>> m_pendingIncludes;
+		std::vector<char, stl_allocator<char>> m_pendingPaths;
+
+	public:
+		session(const config &cfg);
+		session(const session &copy) = delete;
+		~session();
+
+		void add_define(const char* name, const char* value = nullptr);
+		void add_define(std::string_view name, std::string_view value = std::string_view());
+		void remove_define(const char* name);
+		void remove_define(std::string_view name);
+
+		bool has_define(const char* name) const;
+		bool has_define(std::string_view name) const;
+		// Returns the value of the definition in this session, or nullptr if it's not defined
+		const char* get_define(const char* name) const;
+		const char* get_define(std::string_view name) const;
+
+		// Records the lines written by process() into the given map, as coming from the given file
+		void set_line_map(line_map* map, uint32_t file);
+
+		// Fills the given stats on every process() run, if compiled with CCPP_STATS
+		void set_stats(stats* stats);
+
+		// Records process() runs and callbacks into the given tracer
+		void set_tracer(tracer* tracer);
+
+		// Feeds the output of every process() run into the given hasher while it's written. The hasher
+		// isn't reset, so it can also cover the output of included files.
+		void set_output_hasher(hasher* hasher);
+
+		// Returns the length of the output, which is only shorter than the input in compact mode
+		size_t process(char* buffer);
+		size_t process(char* buffer, size_t len);
+
+		// Like process(), but finds directives and erases content on multiple threads, which pays off for
+		// buffers of many megabytes. Directives are still handled in order on this thread, so callbacks
+		// are called the same way. Uses as many threads as there are cores if threads is 0. Buffers that
+		// are language aware, minified or mapped by a line map are processed by process() instead.
+		size_t process_parallel(char* buffer, size_t len, size_t threads = 0);
+
+		// Evaluates conditions like process() and adds the paths of the includes that pass to the given
+		// dependencies, without changing the buffer. Includes aren't followed and no callbacks are called.
+		void scan_dependencies(const char* buffer, size_t len, dependencies &deps);
+
+	private:
+		void clear_defines();
+
+		void begin_process(char* buffer, size_t len);
+		size_t end_process(char* buffer, size_t lenOut);
+
+		void directive(uint8_t &scope);
+		bool test_condition();
+
+		void expect_eol();
+		void consume_line();
+
+		size_t line_at(const char* p);
+
+		void overwrite(char* p, size_t len);
+		void erase(char* p, char* pEnd);
+		void erase_text(char* p, char* pEnd);
+		void keep(char* p);
+		void minify(const char* p, const char* pEnd);
+		void minify_verbatim(const char* p, const char* pEnd);
+		bool skip_region(bool isErasing);
+
+		void line_map_flush(size_t line);
+		void line_map_resume(size_t line);
+
+		void hash_output(const char* pEnd);
+
+		void load_include(std::string_view path);
+		void finish_includes();
+	};
+
+	// A config with a session of its own, where definitions made while processing are kept in the
+	// config for the next run
+	class processor
+	{
+	public:
+		typedef session::stats stats;
+
+	private:
+		config m_config;
+		session m_session;
+
+	public:
+		processor(allocator* alloc = nullptr);
+		processor(const processor &copy);
+
+		void add_define(const char* name, const char* value = nullptr);
+		void add_define(std::string_view name, std::string_view value = std::string_view());
+		void remove_define(const char* name);
+		void remove_define(std::string_view name);
+
+		bool has_define(const char* name) const;
+		bool has_define(std::string_view name) const;
+		// Returns the value of the definition, which is empty if it has no value, or nullptr if it's not defined
+		const char* get_define(const char* name) const;
+		const char* get_define(std::string_view name) const;
+
+		// The callbacks are not copied, so they must outlive the processor (or be replaced before they're gone)
+		void set_include_callback(config::include_callback_t callback);
+		void set_command_callback(config::command_callback_t callback);
+		void set_async_include_callbacks(config::include_load_callback_t load, config::include_ready_callback_t ready);
+		void set_include_prefetcher(prefetcher* prefetcher);
+		void set_snapshot(const snapshot* snapshot);
+
+		// When enabled, comments and strings are skipped over as a whole, so directive characters inside of them are ignored
+		void set_language_aware(bool enabled);
+
+		// Records the lines written by process() into the given map, as coming from the given file
+		void set_line_map(line_map* map, uint32_t file);
+
+		void set_output_mode(output_mode mode);
+		// Removes comments from the output in minify mode
+		void set_strip_comments(bool strip);
+
+		// Fills the given stats on every process() run, if compiled with CCPP_STATS
+		void set_stats(stats* stats);
+
+		// Records process() runs and callbacks into the given tracer
+		void set_tracer(tracer* tracer);
+
+		// Feeds the output of every process() run into the given hasher while it's written
+		void set_output_hasher(hasher* hasher);
+
+		// Returns the length of the output, which is only shorter than the input in compact mode
+		size_t process(char* buffer);
+		size_t process(char* buffer, size_t len);
+		size_t process_parallel(char* buffer, size_t len, size_t threads = 0);
+
+	private:
+		void keep_defines();
+	};
+}
+
+#if defined(CCPP_IMPL)
+
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <cstdlib>
+#include <cstddef>
+#include <algorithm>
+
+#if defined(_WIN32)
+#  ifndef WIN32_LEAN_AND_MEAN
+#    define WIN32_LEAN_AND_MEAN
+#  endif
+#  ifndef NOMINMAX
+#    define NOMINMAX
+#  endif
+#  include <windows.h>
+#  include <sys/utime.h>
+#else
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <fcntl.h>
+#  include <unistd.h>
+#  include <dirent.h>
+#  include <utime.h>
+#endif
+
+#if !defined(CCPP_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64))
+#  define CCPP_SSE2
+#  include <emmintrin.h>
+#  if defined(_MSC_VER)
+#    include <intrin.h>
+#  endif
+#endif
+
+#if defined(CCPP_STATS)
+#  define CCPP_STAT(expr) if (m_stats != nullptr) { m_stats->expr; }
+#  define CCPP_STAT_TIMER(field) stat_timer statTimer(m_stats != nullptr ? &m_stats->field : nullptr)
+#else
+#  define CCPP_STAT(expr)
+#  define CCPP_STAT_TIMER(field)
+#endif
+
+#ifndef CCPP_ERROR
+#  define CCPP_ERROR(error, ...) printf("[CCPP ERROR] " error "\n", ##__VA_ARGS__)
+#endif
+
+#ifndef CCPP_ASSERT
+#  if defined(_DEBUG)
+#    define CCPP_ASSERT(cond) if (!(cond)) { CCPP_ERROR("Assertion failed: '%s' on line %d", #cond, __LINE__); }
+#  else
+#    define CCPP_ASSERT(cond)
+#  endif
+#endif
+
+enum class ELexType
+{
+	None,
+
+	Whitespace,
+	Newline,
+	Word,
+	Operator,
+	String,
+};
+
+static const char* lex_type_name(ELexType type)
+{
+	switch (type) {
+	case ELexType::Whitespace: return "WHITESPACE";
+	case ELexType::Newline: return "NEWLINE";
+	case ELexType::Word: return "WORD";
+	case ELexType::Operator: return "OPERATOR";
+	case ELexType::String: return "STRING";
+	}
+	return "NONE";
+}
+
+static void lex_char_text(char c, char* buffer, size_t size)
+{
+	if (isalnum(c)) {
+		snprintf(buffer, size, "%c", c);
+		return;
+	}
+	snprintf(buffer, size, "\\x%02X", (int)c);
+}
+
+enum
+{
+	LexClass_None,
+	LexClass_Whitespace,
+	LexClass_Newline,
+	LexClass_Word,
+	LexClass_Operator,
+};
+
+// Character class of every possible byte, see the LexClass_ enum
+static const uint8_t lex_char_class[256] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 1, 2, 0, 0, 2, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	1, 4, 0, 0, 0, 0, 4, 0, 4, 4, 0, 0, 0, 0, 0, 0,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 0, 0,
+	0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 0, 0, 0, 3,
+	0, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3,
+	3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 3, 0, 4, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static inline uint8_t lex_class(char c)
+{
+	return lex_char_class[(uint8_t)c];
+}
+
+static size_t lex(char* p, char* pEnd, ELexType &type)
+{
+	type = ELexType::None;
+
+	char* pStart = p;
+	if (p >= pEnd) {
+		return 0;
+	}
+
+	if (*p == '"') {
+		type = ELexType::String;
+
+		p++;
+		while (p < pEnd) {
+			char c = *p++;
+			if (c == '"') {
+				// End of string
+				break;
+			} else if (c == '\\' && p < pEnd) {
+				// Skip next character
+				p++;
+			}
+		}
+
+		return p - pStart;
+	}
+
+	// Characters that don't belong to any class become part of the next token
+	uint8_t cls = lex_class(*p);
+	while (cls == LexClass_None) {
+		if (++p == pEnd) {
+			return p - pStart;
+		}
+		cls = lex_class(*p);
+	}
+
+	switch (cls) {
+	case LexClass_Whitespace:
+		type = ELexType::Whitespace;
+		p++;
+		while (p < pEnd && lex_class(*p) == LexClass_Whitespace) {
+			p++;
+		}
+		break;
+
+	case LexClass_Word:
+		type = ELexType::Word;
+		p++;
+		while (p < pEnd && lex_class(*p) == LexClass_Word) {
+			p++;
+		}
+		break;
+
+	case LexClass_Operator:
+		type = ELexType::Operator;
+		p++;
+		while (p < pEnd && lex_class(*p) == LexClass_Operator) {
+			p++;
+		}
+		break;
+
+	case LexClass_Newline:
+		// Only handle 1 newline at a time, which can be any combination of \r and \n
+		type = ELexType::Newline;
+		if (++p < pEnd && lex_class(*p) == LexClass_Newline && *p != p[-1]) {
+			p++;
+		}
+		break;
+	}
+
+	return p - pStart;
+}
+
+static size_t lex_expect(char* p, char* pEnd, ELexType expected_type)
+{
+	ELexType type;
+	size_t len = lex(p, pEnd, type);
+
+	if (type != expected_type) {
+		char buffer[16];
+		if (p < pEnd) {
+			lex_char_text(*p, buffer, sizeof(buffer));
+		} else {
+			snprintf(buffer, sizeof(buffer), "EOF");
+		}
+		CCPP_ERROR("Unexpected '%s' of type %s, was expecting a %s", buffer, lex_type_name(type), lex_type_name(expected_type));
+		return 0;
+	}
+
+	return len;
+}
+
+#if defined(CCPP_SSE2)
+static inline int scan_first_bit(uint32_t mask)
+{
+#if defined(_MSC_VER)
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+#endif
+
+// Finds the first occurrence of the given character, or returns pEnd if there is none
+static inline char* scan_char(char* p, char* pEnd, char c)
+{
+	char* ret = (char*)memchr(p, c, pEnd - p);
+	if (ret == nullptr) {
+		return pEnd;
+	}
+	return ret;
+}
+
+// Finds the first occurrence of the given character at the start of a line, or returns pEnd if there is none
+static const char* scan_line_start(const char* buffer, const char* pEnd, char c)
+{
+	if (buffer < pEnd && *buffer == c) {
+		return buffer;
+	}
+
+	const char* p = buffer + 1;
+
+#if defined(CCPP_SSE2)
+	const __m128i vc = _mm_set1_epi8(c);
+	const __m128i vn = _mm_set1_epi8('\n');
+
+	// Compare against the bytes one position back as well, to find the ones after a newline
+	while (pEnd - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i prev = _mm_loadu_si128((const __m128i*)(p - 1));
+		__m128i match = _mm_and_si128(_mm_cmpeq_epi8(v, vc), _mm_cmpeq_epi8(prev, vn));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(match);
+		if (mask != 0) {
+			return p + scan_first_bit(mask);
+		}
+		p += 16;
+	}
+#endif
+
+	while (p < pEnd) {
+		p = (const char*)memchr(p, c, pEnd - p);
+		if (p == nullptr) {
+			return pEnd;
+		}
+		if (p[-1] == '\n') {
+			return p;
+		}
+		p++;
+	}
+	return pEnd;
+}
+
+// Counts the occurrences of the given character
+static size_t scan_count(const char* p, const char* pEnd, char c)
+{
+	size_t ret = 0;
+
+#if defined(CCPP_SSE2)
+	const __m128i vc = _mm_set1_epi8(c);
+
+	// Matches are summed per byte, which holds up to 255 blocks before they're added up
+	while (pEnd - p >= 16) {
+		size_t blocks = std::min((size_t)(pEnd - p) / 16, (size_t)255);
+		__m128i sums = _mm_setzero_si128();
+		for (size_t i = 0; i < blocks; i++) {
+			__m128i v = _mm_loadu_si128((const __m128i*)p);
+			sums = _mm_sub_epi8(sums, _mm_cmpeq_epi8(v, vc));
+			p += 16;
+		}
+		__m128i total = _mm_sad_epu8(sums, _mm_setzero_si128());
+		ret += (size_t)_mm_cvtsi128_si32(total) + (size_t)_mm_extract_epi16(total, 4);
+	}
+#endif
+
+	for (; p < pEnd; p++) {
+		if (*p == c) {
+			ret++;
+		}
+	}
+	return ret;
+}
+
+// Finds the first occurrence of any of the 3 given characters, or returns pEnd if there is none
+static char* scan_any(char* p, char* pEnd, char a, char b, char c)
+{
+#if defined(CCPP_SSE2)
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	const __m128i vc = _mm_set1_epi8(c);
+
+	while (pEnd - p >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)p);
+		__m128i match = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)), _mm_cmpeq_epi8(v, vc));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(match);
+		if (mask != 0) {
+			return p + scan_first_bit(mask);
+		}
+		p += 16;
+	}
+#endif
+
+	for (; p < pEnd; p++) {
+		if (*p == a || *p == b || *p == c) {
+			return p;
+		}
+	}
+	return pEnd;
+}
+
+// Returns the end of the comment or string starting at p, or nullptr if there is none starting at p
+static char* scan_region_end(char* p, char* pEnd)
+{
+	char c = *p;
+	char next = (p + 1 < pEnd) ? p[1] : '\0';
+
+	if (c == '/' && next == '/') {
+		// Line comment, which ends before the newline
+		return scan_char(p + 2, pEnd, '\n');
+
+	} else if (c == '/' && next == '*') {
+		// Block comment
+		p += 2;
+		while (p < pEnd) {
+			p = scan_char(p, pEnd, '*');
+			if (p + 1 < pEnd && p[1] == '/') {
+				return p + 2;
+			}
+			if (p < pEnd) {
+				p++;
+			}
+		}
+		return pEnd;
+
+	} else if (c == '"' && next == '"' && p + 2 < pEnd && p[2] == '"') {
+		// Triple quoted string, which has no escape sequences
+		p += 3;
+		while (p < pEnd) {
+			p = scan_char(p, pEnd, '"');
+			if (pEnd - p >= 3 && p[1] == '"' && p[2] == '"') {
+				return p + 3;
+			}
+			if (p < pEnd) {
+				p++;
+			}
+		}
+		return pEnd;
+
+	} else if (c == '"' || c == '\'') {
+		// Regular string, which ends at the closing quote or at an unescaped newline
+		p++;
+		while (p < pEnd) {
+			p = scan_any(p, pEnd, c, '\\', '\n');
+			if (p == pEnd || *p == '\n') {
+				return p;
+			}
+			if (*p == c) {
+				return p + 1;
+			}
+			// Skip the escaped character
+			p += 2;
+		}
+		return pEnd;
+	}
+
+	return nullptr;
+}
+
+#if defined(CCPP_STATS)
+// Adds the time it exists for to a counter, in nanoseconds
+struct stat_timer
+{
+	uint64_t* counter;
+	std::chrono::steady_clock::time_point start;
+
+	stat_timer(uint64_t* c)
+		: counter(c)
+	{
+		if (counter != nullptr) {
+			start = std::chrono::steady_clock::now();
+		}
+	}
+
+	~stat_timer()
+	{
+		if (counter != nullptr) {
+			*counter += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+};
+#endif
+
+char ccpp::character = '#';
+
+enum
+{
+	// Contents must pass
+	Scope_Passing = (1 << 0),
+
+	// Contents must be erased
+	Scope_Erasing = (1 << 1),
+
+	// Contents are inside of an else directive
+	Scope_Else = (1 << 2),
+
+	// Contents are inside of an else if directive
+	Scope_ElseIf = (1 << 3),
+
+	// Contents are deep and should be ignored
+	Scope_Deep = (1 << 4),
+};
+
+#ifndef CCPP_MAX_EVAL_DEPTH
+#  define CCPP_MAX_EVAL_DEPTH 16
+#endif
+
+#ifndef CCPP_MAX_CONDITION_NESTING
+#  define CCPP_MAX_CONDITION_NESTING 256
+#endif
+
+enum
+{
+	Op_None,
+
+	Op_Mul,
+	Op_Div,
+	Op_Mod,
+	Op_Add,
+	Op_Sub,
+	Op_Shl,
+	Op_Shr,
+	Op_Less,
+	Op_LessEqual,
+	Op_Greater,
+	Op_GreaterEqual,
+	Op_Equal,
+	Op_NotEqual,
+	Op_BitAnd,
+	Op_BitXor,
+	Op_BitOr,
+	Op_And,
+	Op_Or,
+	Op_Ternary,
+};
+
+// State of a condition being evaluated
+struct condition_parser
+{
+	const ccpp::session* session;
+
+	const char* p;
+	const char* pEnd;
+
+	int line;
+
+	// How many definition values deep we are
+	int depth;
+
+	// How many parentheses, prefix operators and ternary branches deep we are
+	int nesting;
+
+	// Greater than 0 while parsing an operand that is not evaluated (eg. the right side of "0 && x")
+	int skip;
+
+	bool error;
+};
+
+static int64_t cond_parse_expression(condition_parser &cp, int minPrecedence);
+
+static bool cond_is_word(char c)
+{
+	return lex_class(c) == LexClass_Word;
+}
+
+static bool cond_is_end(const condition_parser &cp)
+{
+	return cp.p >= cp.pEnd || *cp.p == '\r' || *cp.p == '\n';
+}
+
+static void cond_skip_whitespace(condition_parser &cp)
+{
+	while (cp.p < cp.pEnd && (*cp.p == ' ' || *cp.p == '\t')) {
+		cp.p++;
+	}
+}
+
+static void cond_unexpected(condition_parser &cp)
+{
+	if (cp.error) {
+		return;
+	}
+	cp.error = true;
+
+	if (cond_is_end(cp)) {
+		CCPP_ERROR("Unexpected end of condition on line %d", cp.line);
+	} else {
+		char buffer[16];
+		lex_char_text(*cp.p, buffer, sizeof(buffer));
+		CCPP_ERROR("Unexpected '%s' in condition on line %d", buffer, cp.line);
+	}
+}
+
+// Enters a nested part of the condition, or reports an error if it nests too deeply
+static bool cond_enter(condition_parser &cp)
+{
+	if (cp.nesting >= CCPP_MAX_CONDITION_NESTING) {
+		if (!cp.error) {
+			CCPP_ERROR("Condition nests too deeply on line %d", cp.line);
+			cp.error = true;
+		}
+		return false;
+	}
+	cp.nesting++;
+	return true;
+}
+
+static bool cond_expect(condition_parser &cp, char c)
+{
+	cond_skip_whitespace(cp);
+	if (cp.p < cp.pEnd && *cp.p == c) {
+		cp.p++;
+		return true;
+	}
+	cond_unexpected(cp);
+	return false;
+}
+
+// Peeks at a binary operator and returns its Op_ value, or Op_None if there is no binary operator
+static int cond_peek_operator(const condition_parser &cp, int &precedence, int &length)
+{
+	const char* p = cp.p;
+	char next = (p + 1 < cp.pEnd) ? p[1] : '\0';
+
+	length = 1;
+
+	if (p >= cp.pEnd) {
+		return Op_None;
+	}
+
+	switch (*p) {
+	case '*': precedence = 10; return Op_Mul;
+	case '/': precedence = 10; return Op_Div;
+	case '%': precedence = 10; return Op_Mod;
+	case '+': precedence = 9; return Op_Add;
+	case '-': precedence = 9; return Op_Sub;
+	case '<':
+		if (next == '<') { length = 2; precedence = 8; return Op_Shl; }
+		if (next == '=') { length = 2; precedence = 7; return Op_LessEqual; }
+		precedence = 7; return Op_Less;
+	case '>':
+		if (next == '>') { length = 2; precedence = 8; return Op_Shr; }
+		if (next == '=') { length = 2; precedence = 7; return Op_GreaterEqual; }
+		precedence = 7; return Op_Greater;
+	case '=':
+		if (next == '=') { length = 2; precedence = 6; return Op_Equal; }
+		return Op_None;
+	case '!':
+		if (next == '=') { length = 2; precedence = 6; return Op_NotEqual; }
+		return Op_None;
+	case '&':
+		if (next == '&') { length = 2; precedence = 2; return Op_And; }
+		precedence = 5; return Op_BitAnd;
+	case '^': precedence = 4; return Op_BitXor;
+	case '|':
+		if (next == '|') { length = 2; precedence = 1; return Op_Or; }
+		precedence = 3; return Op_BitOr;
+	case '?': precedence = 0; return Op_Ternary;
+	}
+
+	return Op_None;
+}
+
+static int64_t cond_apply(condition_parser &cp, int op, int64_t lhs, int64_t rhs)
+{
+	// Arithmetic is done unsigned so that overflow wraps around instead of being undefined
+	uint64_t ulhs = (uint64_t)lhs;
+	uint64_t urhs = (uint64_t)rhs;
+
+	switch (op) {
+	case Op_Mul: return (int64_t)(ulhs * urhs);
+	case Op_Div:
+	case Op_Mod:
+		if (rhs == 0) {
+			if (cp.skip == 0 && !cp.error) {
+				CCPP_ERROR("Division by zero in condition on line %d", cp.line);
+				cp.error = true;
+			}
+			return 0;
+		}
+		if (rhs == -1) {
+			return (op == Op_Div) ? (int64_t)(0 - ulhs) : 0;
+		}
+		return (op == Op_Div) ? (lhs / rhs) : (lhs % rhs);
+	case Op_Add: return (int64_t)(ulhs + urhs);
+	case Op_Sub: return (int64_t)(ulhs - urhs);
+	case Op_Shl: return (int64_t)(ulhs << (urhs & 63));
+	case Op_Shr: return lhs >> (urhs & 63);
+	case Op_Less: return lhs < rhs;
+	case Op_LessEqual: return lhs <= rhs;
+	case Op_Greater: return lhs > rhs;
+	case Op_GreaterEqual: return lhs >= rhs;
+	case Op_Equal: return lhs == rhs;
+	case Op_NotEqual: return lhs != rhs;
+	case Op_BitAnd: return lhs & rhs;
+	case Op_BitXor: return lhs ^ rhs;
+	case Op_BitOr: return lhs | rhs;
+	case Op_And: return lhs && rhs;
+	case Op_Or: return lhs || rhs;
+	}
+
+	return 0;
+}
+
+static int64_t cond_parse_number(condition_parser &cp)
+{
+	uint64_t value = 0;
+	int base = 10;
+
+	if (*cp.p == '0' && cp.p + 1 < cp.pEnd) {
+		char c = cp.p[1];
+		if (c == 'x' || c == 'X') {
+			base = 16;
+			cp.p += 2;
+		} else if (c == 'b' || c == 'B') {
+			base = 2;
+			cp.p += 2;
+		} else {
+			base = 8;
+		}
+	}
+
+	const char* digitsStart = cp.p;
+	while (cp.p < cp.pEnd) {
+		char c = *cp.p;
+		int digit;
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			break;
+		}
+		if (digit >= base) {
+			break;
+		}
+		value = value * base + digit;
+		cp.p++;
+	}
+
+	// Skip integer suffixes
+	while (cp.p < cp.pEnd && (*cp.p == 'u' || *cp.p == 'U' || *cp.p == 'l' || *cp.p == 'L')) {
+		cp.p++;
+	}
+
+	if (cp.p == digitsStart || (cp.p < cp.pEnd && cond_is_word(*cp.p))) {
+		if (!cp.error) {
+			CCPP_ERROR("Invalid integer literal in condition on line %d", cp.line);
+			cp.error = true;
+		}
+		while (cp.p < cp.pEnd && cond_is_word(*cp.p)) {
+			cp.p++;
+		}
+	}
+
+	return (int64_t)value;
+}
+
+static int64_t cond_define_value(condition_parser &cp, std::string_view name)
+{
+	const char* value = cp.session->get_define(name);
+	if (value == nullptr) {
+		return 0;
+	}
+	if (*value == '\0') {
+		return 1;
+	}
+
+	if (cp.depth >= CCPP_MAX_EVAL_DEPTH) {
+		if (!cp.error) {
+			CCPP_ERROR("Definition \"%.*s\" nests too deeply in condition on line %d", (int)name.size(), name.data(), cp.line);
+			cp.error = true;
+		}
+		return 0;
+	}
+
+	// Evaluate the value of the definition as an expression of its own
+	condition_parser sub = cp;
+	sub.p = value;
+	sub.pEnd = value + strlen(value);
+	sub.depth++;
+
+	int64_t result = cond_parse_expression(sub, 0);
+	cond_skip_whitespace(sub);
+	if (!sub.error && sub.p < sub.pEnd) {
+		CCPP_ERROR("Definition \"%.*s\" is not an integer expression in condition on line %d", (int)name.size(), name.data(), cp.line);
+		sub.error = true;
+	}
+
+	cp.error = sub.error;
+	return result;
+}
+
+static int64_t cond_parse_unary(condition_parser &cp)
+{
+	cond_skip_whitespace(cp);
+	if (cond_is_end(cp)) {
+		cond_unexpected(cp);
+		return 0;
+	}
+
+	char c = *cp.p;
+
+	if (c == '!' || c == '~' || c == '-' || c == '+') {
+		cp.p++;
+		if (!cond_enter(cp)) {
+			return 0;
+		}
+		int64_t value = cond_parse_unary(cp);
+		cp.nesting--;
+
+		if (c == '!') {
+			return !value;
+		} else if (c == '~') {
+			return ~value;
+		} else if (c == '-') {
+			return (int64_t)(0 - (uint64_t)value);
+		}
+		return value;
+	}
+
+	if (c == '(') {
+		cp.p++;
+		int64_t value = cond_parse_expression(cp, 0);
+		cond_expect(cp, ')');
+		return value;
+	}
+
+	if (c >= '0' && c <= '9') {
+		return cond_parse_number(cp);
+	}
+
+	if (!cond_is_word(c)) {
+		cond_unexpected(cp);
+		return 0;
+	}
+
+	const char* wordStart = cp.p;
+	while (cp.p < cp.pEnd && cond_is_word(*cp.p)) {
+		cp.p++;
+	}
+	size_t lenWord = cp.p - wordStart;
+
+	bool isDefined = (lenWord == 7 && !strncmp(wordStart, "defined", 7));
+	if (isDefined) {
+		// defined(<word>) or defined <word>
+		cond_skip_whitespace(cp);
+		bool hasParens = (cp.p < cp.pEnd && *cp.p == '(');
+		if (hasParens) {
+			cp.p++;
+			cond_skip_whitespace(cp);
+		}
+
+		if (cp.p >= cp.pEnd || !cond_is_word(*cp.p) || (*cp.p >= '0' && *cp.p <= '9')) {
+			cond_unexpected(cp);
+			return 0;
+		}
+
+		wordStart = cp.p;
+		while (cp.p < cp.pEnd && cond_is_word(*cp.p)) {
+			cp.p++;
+		}
+		lenWord = cp.p - wordStart;
+
+		if (hasParens && !cond_expect(cp, ')')) {
+			return 0;
+		}
+	}
+
+	std::string_view word(wordStart, lenWord);
+
+	if (isDefined) {
+		return cp.session->has_define(word) ? 1 : 0;
+	}
+	return cond_define_value(cp, word);
+}
+
+static int64_t cond_parse_expression(condition_parser &cp, int minPrecedence)
+{
+	if (!cond_enter(cp)) {
+		return 0;
+	}
+
+	int64_t lhs = cond_parse_unary(cp);
+
+	while (!cp.error) {
+		cond_skip_whitespace(cp);
+
+		int precedence;
+		int length;
+		int op = cond_peek_operator(cp, precedence, length);
+		if (op == Op_None || precedence < minPrecedence) {
+			break;
+		}
+		cp.p += length;
+
+		if (op == Op_Ternary) {
+			// <cond> ? <a> : <b>, only one of the two branches is evaluated
+			bool passed = (lhs != 0);
+
+			if (!passed) {
+				cp.skip++;
+			}
+			int64_t a = cond_parse_expression(cp, 0);
+			if (!passed) {
+				cp.skip--;
+			}
+
+			if (!cond_expect(cp, ':')) {
+				break;
+			}
+
+			if (passed) {
+				cp.skip++;
+			}
+			int64_t b = cond_parse_expression(cp, precedence);
+			if (passed) {
+				cp.skip--;
+			}
+
+			lhs = passed ? a : b;
+			continue;
+		}
+
+		// Don't evaluate the right hand side of && and || if the left hand side already decides the result
+		bool shortCircuit = (op == Op_And && lhs == 0) || (op == Op_Or && lhs != 0);
+
+		if (shortCircuit) {
+			cp.skip++;
+		}
+		int64_t rhs = cond_parse_expression(cp, precedence + 1);
+		if (shortCircuit) {
+			cp.skip--;
+		}
+
+		lhs = cond_apply(cp, op, lhs, rhs);
+	}
+
+	cp.nesting--;
+	return lhs;
+}
+
+class malloc_allocator : public ccpp::allocator
+{
+public:
+	virtual void* allocate(size_t size) override
+	{
+		return malloc(size);
+	}
+
+	virtual void deallocate(void* p, size_t) override
+	{
+		free(p);
+	}
+};
+
+ccpp::allocator* ccpp::default_allocator()
+{
+	static malloc_allocator instance;
+	return &instance;
+}
+
+static ccpp::allocator* resolve_allocator(ccpp::allocator* alloc)
+{
+	return (alloc != nullptr) ? alloc : ccpp::default_allocator();
+}
+
+ccpp::line_map::line_map(allocator* alloc)
+	: m_runs(stl_allocator<run>(resolve_allocator(alloc)))
+{
+	m_outputLine = 1;
+}
+
+void ccpp::line_map::clear()
+{
+	m_runs.clear();
+	m_outputLine = 1;
+}
+
+void ccpp::line_map::mark(uint32_t file, uint32_t source_line)
+{
+	if (m_runs.size() > 0) {
+		run &last = m_runs.back();
+
+		// Nothing to store if this continues the last run
+		if (last.file == file && source_line - last.source_line == m_outputLine - last.output_line) {
+			return;
+		}
+
+		// Replace the last run if it didn't cover any lines
+		if (last.output_line == m_outputLine) {
+			last.file = file;
+			last.source_line = source_line;
+			return;
+		}
+	}
+
+	run r;
+	r.output_line = m_outputLine;
+	r.file = file;
+	r.source_line = source_line;
+	m_runs.emplace_back(r);
+}
+
+void ccpp::line_map::advance(uint32_t lines)
+{
+	m_outputLine += lines;
+}
+
+uint32_t ccpp::line_map::output_line() const
+{
+	return m_outputLine;
+}
+
+size_t ccpp::line_map::run_count() const
+{
+	return m_runs.size();
+}
+
+bool ccpp::line_map::lookup(uint32_t output_line, location &out) const
+{
+	// Find the last run that starts at or before the line
+	size_t lo = 0;
+	size_t hi = m_runs.size();
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (m_runs[mid].output_line <= output_line) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	if (lo == 0) {
+		return false;
+	}
+
+	const run &r = m_runs[lo - 1];
+	out.file = r.file;
+	out.line = r.source_line + (output_line - r.output_line);
+	return true;
+}
+
+static uint64_t trace_time()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+ccpp::tracer::tracer(allocator* alloc)
+	: m_events(stl_allocator<event>(resolve_allocator(alloc)))
+	, m_strings(stl_allocator<char>(resolve_allocator(alloc)))
+{
+	m_start = trace_time();
+}
+
+void ccpp::tracer::clear()
+{
+	m_events.clear();
+	m_strings.clear();
+	m_start = trace_time();
+}
+
+void ccpp::tracer::begin(const char* name, const char* detail)
+{
+	begin(name, detail, detail != nullptr ? strlen(detail) : 0);
+}
+
+void ccpp::tracer::begin(const char* name, const char* detail, size_t lenDetail)
+{
+	event e;
+	e.time = trace_time();
+	e.name = add_string(name, strlen(name));
+	e.detail = (detail != nullptr) ? add_string(detail, lenDetail) : UINT32_MAX;
+	e.begin = true;
+	m_events.emplace_back(e);
+}
+
+void ccpp::tracer::end()
+{
+	event e;
+	e.time = trace_time();
+	e.name = UINT32_MAX;
+	e.detail = UINT32_MAX;
+	e.begin = false;
+	m_events.emplace_back(e);
+}
+
+size_t ccpp::tracer::event_count() const
+{
+	return m_events.size();
+}
+
+uint32_t ccpp::tracer::add_string(const char* str, size_t len)
+{
+	// All strings are kept in one buffer, so events don't allocate on their own
+	uint32_t ret = (uint32_t)m_strings.size();
+	m_strings.append(str, len);
+	m_strings.push_back('\0');
+	return ret;
+}
+
+template<typename TString>
+static void trace_write_string(TString &out, const char* str)
+{
+	out += '"';
+	for (; *str != '\0'; str++) {
+		char c = *str;
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if ((unsigned char)c < 0x20) {
+			char buffer[8];
+			snprintf(buffer, sizeof(buffer), "\\u%04x", (int)c);
+			out += buffer;
+		} else {
+			out += c;
+		}
+	}
+	out += '"';
+}
+
+void ccpp::tracer::write_json(std::string &out) const
+{
+	write_json_to(out);
+}
+
+template<typename TString>
+void ccpp::tracer::write_json_to(TString &out) const
+{
+	out += "{\"traceEvents\":[";
+
+	for (size_t i = 0; i < m_events.size(); i++) {
+		const event &e = m_events[i];
+
+		char buffer[64];
+		snprintf(buffer, sizeof(buffer), "%.3f", (e.time - m_start) / 1000.0);
+
+		if (i > 0) {
+			out += ',';
+		}
+		out += "\n{\"ph\":\"";
+		out += e.begin ? 'B' : 'E';
+		out += "\",\"ts\":";
+		out += buffer;
+		out += ",\"pid\":1,\"tid\":1";
+
+		if (e.begin) {
+			out += ",\"cat\":\"ccpp\",\"name\":";
+			trace_write_string(out, m_strings.c_str() + e.name);
+
+			if (e.detail != UINT32_MAX) {
+				out += ",\"args\":{\"detail\":";
+				trace_write_string(out, m_strings.c_str() + e.detail);
+				out += '}';
+			}
+		}
+
+		out += '}';
+	}
+
+	out += "\n]}\n";
+}
+
+bool ccpp::tracer::save_json(const char* path) const
+{
+	// Build the json with our own allocator
+	std::basic_string<char, std::char_traits<char>, stl_allocator<char>> json(m_strings.get_allocator());
+	write_json_to(json);
+
+	FILE* fh = fopen(path, "wb");
+	if (fh == nullptr) {
+		return false;
+	}
+
+	bool ret = (fwrite(json.data(), 1, json.size(), fh) == json.size());
+	fclose(fh);
+	return ret;
+}
+
+static ccpp::directive_kind directive_kind_of(std::string_view word)
+{
+	if (word == "define") { return ccpp::directive_define; }
+	if (word == "undef") { return ccpp::directive_undef; }
+	if (word == "if") { return ccpp::directive_if; }
+	if (word == "elif") { return ccpp::directive_elif; }
+	if (word == "else") { return ccpp::directive_else; }
+	if (word == "endif") { return ccpp::directive_endif; }
+	if (word == "include") { return ccpp::directive_include; }
+	return ccpp::directive_command;
+}
+
+ccpp::directive_list::directive_list(allocator* alloc)
+	: m_directives(stl_allocator<directive_record>(resolve_allocator(alloc)))
+{
+}
+
+void ccpp::directive_list::find(const char* buffer, size_t len)
+{
+	m_directives.clear();
+
+	char* p = (char*)buffer;
+	char* pEnd = p + len;
+
+	// Lines are only counted up to the directives
+	size_t line = 1;
+	const char* lineCounted = buffer;
+
+	while ((p = scan_char(p, pEnd, ccpp::character)) < pEnd) {
+		char* start = p++;
+		if (start != buffer && start[-1] != '\n') {
+			continue;
+		}
+
+		ELexType type;
+		size_t lenName = lex(p, pEnd, type);
+		if (type != ELexType::Word) {
+			continue;
+		}
+
+		line += scan_count(lineCounted, start, '\n');
+		lineCounted = start;
+
+		char* lineEnd = scan_char(p, pEnd, '\n');
+		char* contentEnd = lineEnd;
+		if (contentEnd > start && contentEnd[-1] == '\r') {
+			contentEnd--;
+		}
+
+		char* argument = p + lenName;
+		while (argument < contentEnd && (*argument == ' ' || *argument == '\t')) {
+			argument++;
+		}
+		char* argumentEnd = contentEnd;
+		while (argumentEnd > argument && (argumentEnd[-1] == ' ' || argumentEnd[-1] == '\t')) {
+			argumentEnd--;
+		}
+
+		directive_record record;
+		record.kind = directive_kind_of(std::string_view(p, lenName));
+		record.line = (uint32_t)line;
+		record.offset = (uint32_t)(start - buffer);
+		record.length = (uint32_t)(contentEnd - start);
+		record.name = (uint32_t)(p - buffer);
+		record.lenName = (uint32_t)lenName;
+		record.argument = (uint32_t)(argument - buffer);
+		record.lenArgument = (uint32_t)(argumentEnd - argument);
+		m_directives.emplace_back(record);
+
+		p = lineEnd;
+	}
+}
+
+void ccpp::directive_list::clear()
+{
+	m_directives.clear();
+}
+
+size_t ccpp::directive_list::size() const
+{
+	return m_directives.size();
+}
+
+const ccpp::directive_record &ccpp::directive_list::operator[](size_t index) const
+{
+	return m_directives[index];
+}
+
+const ccpp::directive_record* ccpp::directive_list::begin() const
+{
+	return m_directives.data();
+}
+
+const ccpp::directive_record* ccpp::directive_list::end() const
+{
+	return m_directives.data() + m_directives.size();
+}
+
+ccpp::dependencies::dependencies(allocator* alloc)
+	: m_paths(stl_allocator<path_string>(resolve_allocator(alloc)))
+	, m_known(stl_allocator<std::string_view>(resolve_allocator(alloc)))
+{
+}
+
+void ccpp::dependencies::clear()
+{
+	m_known.clear();
+	m_paths.clear();
+}
+
+bool ccpp::dependencies::add(std::string_view path)
+{
+	if (m_known.find(path) != m_known.end()) {
+		return false;
+	}
+
+	m_paths.emplace_back(path.data(), path.size(), m_paths.get_allocator());
+	m_known.emplace(m_paths.back().data(), path.size());
+	return true;
+}
+
+size_t ccpp::dependencies::size() const
+{
+	return m_paths.size();
+}
+
+std::string_view ccpp::dependencies::operator[](size_t index) const
+{
+	const path_string &path = m_paths[index];
+	return std::string_view(path.data(), path.size());
+}
+
+// Escapes characters that Make would otherwise interpret
+template<typename TString>
+static void depfile_write_path(TString &out, std::string_view path)
+{
+	for (char c : path) {
+		if (c == ' ' || c == '#') {
+			out += '\\';
+		} else if (c == '$') {
+			out += '$';
+		}
+		out += c;
+	}
+}
+
+void ccpp::dependencies::write_depfile(std::string &out, std::string_view target) const
+{
+	write_depfile_to(out, target);
+}
+
+template<typename TString>
+void ccpp::dependencies::write_depfile_to(TString &out, std::string_view target) const
+{
+	depfile_write_path(out, target);
+	out += ':';
+
+	for (const path_string &path : m_paths) {
+		out += " \\\n  ";
+		depfile_write_path(out, std::string_view(path.data(), path.size()));
+	}
+
+	out += '\n';
+}
+
+bool ccpp::dependencies::save_depfile(const char* path, std::string_view target) const
+{
+	path_string depfile(m_paths.get_allocator());
+	write_depfile_to(depfile, target);
+
+	FILE* fh = fopen(path, "wb");
+	if (fh == nullptr) {
+		return false;
+	}
+
+	bool ret = (fwrite(depfile.data(), 1, depfile.size(), fh) == depfile.size());
+	fclose(fh);
+	return ret;
+}
+
+// Finds the path of every include in the buffer, regardless of conditions
+template<typename TCallback>
+static void prefetch_scan(const char* buffer, size_t len, TCallback onInclude)
+{
+	char* p = (char*)buffer;
+	char* pEnd = p + len;
+
+	while ((p = scan_char(p, pEnd, ccpp::character)) < pEnd) {
+		bool lineStart = (p == buffer || p[-1] == '\n');
+		p++;
+		if (!lineStart) {
+			continue;
+		}
+
+		ELexType type;
+		size_t lenWord = lex(p, pEnd, type);
+		if (type != ELexType::Word || lenWord != 7 || memcmp(p, "include", 7)) {
+			continue;
+		}
+		p += lenWord;
+
+		size_t lenWhitespace = lex(p, pEnd, type);
+		if (type != ELexType::Whitespace) {
+			continue;
+		}
+		p += lenWhitespace;
+
+		size_t lenPath = lex(p, pEnd, type);
+		if (type != ELexType::String) {
+			continue;
+		}
+
+		// Same as the path of the include directive
+		size_t lenPathQuotes = (lenPath >= 2 && p[lenPath - 1] == '"') ? 2 : 1;
+		onInclude(std::string_view(p + 1, lenPath - lenPathQuotes));
+		p += lenPath;
+	}
+}
+
+ccpp::prefetcher::prefetcher(read_callback_t read, size_t threads, allocator* alloc)
+	: m_allocator(resolve_allocator(alloc))
+	, m_read(read)
+	, m_snapshot(nullptr)
+	, m_stopping(false)
+	, m_reading(0)
+	, m_paths(stl_allocator<path_string>(m_allocator))
+	, m_files(stl_allocator<std::pair<const std::string_view, content_future>>(m_allocator))
+	, m_jobs(stl_allocator<job>(m_allocator))
+	, m_threads(stl_allocator<std::thread>(m_allocator))
+{
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+		if (threads == 0) {
+			threads = 1;
+		}
+	}
+
+	m_threads.reserve(threads);
+	for (size_t i = 0; i < threads; i++) {
+		m_threads.emplace_back(&prefetcher::run, this);
+	}
+}
+
+ccpp::prefetcher::~prefetcher()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+	m_wake.notify_all();
+
+	for (std::thread &thread : m_threads) {
+		thread.join();
+	}
+
+	// Anything still waiting for a file that was never read doesn't get it
+	for (job &j : m_jobs) {
+		j.content.set_value(std::nullopt);
+	}
+}
+
+void ccpp::prefetcher::prefetch(const char* buffer, size_t len)
+{
+	// Find the includes without holding up the threads
+	std::vector<std::string_view, stl_allocator<std::string_view>> includes{ stl_allocator<std::string_view>(m_allocator) };
+	prefetch_scan(buffer, len, [&includes](std::string_view path) {
+		includes.push_back(path);
+	});
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (std::string_view path : includes) {
+		queue(path, false);
+	}
+}
+
+std::future<std::optional<std::string>> ccpp::prefetcher::load(std::string_view path)
+{
+	content_future content;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		// A file that is needed right now goes before the prefetched ones
+		queue(path, true);
+		content = m_files.find(path)->second;
+	}
+
+	// Every include gets its own copy, since it may be processed in place
+	return std::async(std::launch::deferred, [content]() {
+		return content.get();
+	});
+}
+
+void ccpp::prefetcher::clear()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// The threads refer to the paths while they're reading
+	m_idle.wait(lock, [this]() { return m_jobs.empty() && m_reading == 0; });
+
+	m_files.clear();
+	m_paths.clear();
+}
+
+void ccpp::prefetcher::set_snapshot(const snapshot* snapshot)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+
+	// Files that are being loaded may still be taken from the old snapshot
+	m_idle.wait(lock, [this]() { return m_reading == 0; });
+	m_snapshot = snapshot;
+}
+
+void ccpp::prefetcher::queue(std::string_view path, bool urgent)
+{
+	auto it = m_files.find(path);
+	if (it != m_files.end()) {
+		// Move the file to the front if it's still waiting
+		if (urgent) {
+			for (auto itJob = m_jobs.begin(); itJob != m_jobs.end(); itJob++) {
+				if (itJob->path == path) {
+					job j = std::move(*itJob);
+					m_jobs.erase(itJob);
+					m_jobs.emplace_front(std::move(j));
+					break;
+				}
+			}
+		}
+		return;
+	}
+
+	m_paths.emplace_back(path.data(), path.size(), m_paths.get_allocator());
+	std::string_view storedPath(m_paths.back().data(), path.size());
+
+	job j{ storedPath, content_promise(std::allocator_arg, stl_allocator<char>(m_allocator)) };
+	m_files.emplace(storedPath, j.content.get_future().share());
+
+	if (urgent) {
+		m_jobs.emplace_front(std::move(j));
+	} else {
+		m_jobs.emplace_back(std::move(j));
+	}
+	m_wake.notify_one();
+}
+
+void ccpp::prefetcher::run()
+{
+	std::vector<std::string_view, stl_allocator<std::string_view>> includes{ stl_allocator<std::string_view>(m_allocator) };
+
+	while (true) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_wake.wait(lock, [this]() { return m_stopping || !m_jobs.empty(); });
+		if (m_stopping) {
+			return;
+		}
+
+		job j = std::move(m_jobs.front());
+		m_jobs.pop_front();
+		m_reading++;
+		const snapshot* snapshot = m_snapshot;
+		lock.unlock();
+
+		// Files in the snapshot don't have to be read, but what they include still has to be queued
+		std::optional<std::string> content;
+		std::string_view stored;
+		if (snapshot != nullptr && snapshot->get_file(j.path, stored)) {
+			content = std::string(stored);
+		} else {
+			content = m_read(j.path);
+		}
+
+		// Find what this file includes without holding up the other threads
+		includes.clear();
+		if (content) {
+			prefetch_scan(content->data(), content->size(), [&includes](std::string_view path) {
+				includes.push_back(path);
+			});
+		}
+
+		lock.lock();
+
+		// Queue up everything this file includes before handing it over
+		for (std::string_view path : includes) {
+			queue(path, false);
+		}
+
+		m_reading--;
+		if (m_reading == 0) {
+			m_idle.notify_all();
+		}
+		lock.unlock();
+
+		j.content.set_value(std::move(content));
+	}
+}
+
+static const uint64_t hash_prime1 = 0x9E3779B185EBCA87ull;
+static const uint64_t hash_prime2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64_t hash_prime3 = 0x165667B19E3779F9ull;
+static const uint64_t hash_prime4 = 0x85EBCA77C2B2AE63ull;
+static const uint64_t hash_prime5 = 0x27D4EB2F165667C5ull;
+
+static inline uint64_t hash_rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t hash_read64(const uint8_t* p)
+{
+	uint64_t ret;
+	memcpy(&ret, p, sizeof(ret));
+	return ret;
+}
+
+static inline uint32_t hash_read32(const uint8_t* p)
+{
+	uint32_t ret;
+	memcpy(&ret, p, sizeof(ret));
+	return ret;
+}
+
+static inline uint64_t hash_round(uint64_t acc, uint64_t input)
+{
+	acc += input * hash_prime2;
+	acc = hash_rotl(acc, 31);
+	return acc * hash_prime1;
+}
+
+static inline uint64_t hash_merge(uint64_t acc, uint64_t value)
+{
+	acc ^= hash_round(0, value);
+	return acc * hash_prime1 + hash_prime4;
+}
+
+ccpp::hasher::hasher(uint64_t seed)
+{
+	reset(seed);
+}
+
+void ccpp::hasher::reset(uint64_t seed)
+{
+	m_seed = seed;
+	m_acc[0] = seed + hash_prime1 + hash_prime2;
+	m_acc[1] = seed + hash_prime2;
+	m_acc[2] = seed;
+	m_acc[3] = seed - hash_prime1;
+	m_buffered = 0;
+	m_total = 0;
+}
+
+void ccpp::hasher::update(const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+	const uint8_t* pEnd = p + len;
+	m_total += len;
+
+	// Fill up what's left over from the last update first
+	if (m_buffered > 0) {
+		size_t fill = sizeof(m_buffer) - m_buffered;
+		if (len < fill) {
+			memcpy(m_buffer + m_buffered, p, len);
+			m_buffered += len;
+			return;
+		}
+
+		memcpy(m_buffer + m_buffered, p, fill);
+		p += fill;
+		for (int i = 0; i < 4; i++) {
+			m_acc[i] = hash_round(m_acc[i], hash_read64(m_buffer + i * 8));
+		}
+		m_buffered = 0;
+	}
+
+	// Stripes of 32 bytes go straight into the accumulators
+	if (pEnd - p >= 32) {
+		uint64_t acc0 = m_acc[0];
+		uint64_t acc1 = m_acc[1];
+		uint64_t acc2 = m_acc[2];
+		uint64_t acc3 = m_acc[3];
+
+		do {
+			acc0 = hash_round(acc0, hash_read64(p));
+			acc1 = hash_round(acc1, hash_read64(p + 8));
+			acc2 = hash_round(acc2, hash_read64(p + 16));
+			acc3 = hash_round(acc3, hash_read64(p + 24));
+			p += 32;
+		} while (pEnd - p >= 32);
+
+		m_acc[0] = acc0;
+		m_acc[1] = acc1;
+		m_acc[2] = acc2;
+		m_acc[3] = acc3;
+	}
+
+	if (p < pEnd) {
+		memcpy(m_buffer, p, pEnd - p);
+		m_buffered = pEnd - p;
+	}
+}
+
+void ccpp::hasher::update(std::string_view data)
+{
+	update(data.data(), data.size());
+}
+
+uint64_t ccpp::hasher::digest() const
+{
+	uint64_t ret;
+	if (m_total >= 32) {
+		ret = hash_rotl(m_acc[0], 1) + hash_rotl(m_acc[1], 7) + hash_rotl(m_acc[2], 12) + hash_rotl(m_acc[3], 18);
+		for (int i = 0; i < 4; i++) {
+			ret = hash_merge(ret, m_acc[i]);
+		}
+	} else {
+		ret = m_seed + hash_prime5;
+	}
+	ret += m_total;
+
+	const uint8_t* p = m_buffer;
+	const uint8_t* pEnd = m_buffer + m_buffered;
+
+	for (; pEnd - p >= 8; p += 8) {
+		ret ^= hash_round(0, hash_read64(p));
+		ret = hash_rotl(ret, 27) * hash_prime1 + hash_prime4;
+	}
+	if (pEnd - p >= 4) {
+		ret ^= (uint64_t)hash_read32(p) * hash_prime1;
+		ret = hash_rotl(ret, 23) * hash_prime2 + hash_prime3;
+		p += 4;
+	}
+	for (; p < pEnd; p++) {
+		ret ^= *p * hash_prime5;
+		ret = hash_rotl(ret, 11) * hash_prime1;
+	}
+
+	ret ^= ret >> 33;
+	ret *= hash_prime2;
+	ret ^= ret >> 29;
+	ret *= hash_prime3;
+	ret ^= ret >> 32;
+	return ret;
+}
+
+uint64_t ccpp::hasher::hash(const void* data, size_t len, uint64_t seed)
+{
+	hasher h(seed);
+	h.update(data, len);
+	return h.digest();
+}
+
+// Maps a whole file into memory for reading. Returns nullptr if it can't be read or is smaller than minSize.
+static const char* map_file(const char* path, size_t minSize, size_t &size)
+{
+#if defined(_WIN32)
+	HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (file == INVALID_HANDLE_VALUE) {
+		return nullptr;
+	}
+
+	LARGE_INTEGER fileSize;
+	HANDLE mapping = nullptr;
+	if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && (uint64_t)fileSize.QuadPart >= minSize) {
+		mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	}
+	CloseHandle(file);
+	if (mapping == nullptr) {
+		return nullptr;
+	}
+
+	// The view keeps the mapping alive
+	void* data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	CloseHandle(mapping);
+	if (data == nullptr) {
+		return nullptr;
+	}
+
+	size = (size_t)fileSize.QuadPart;
+	return (const char*)data;
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		return nullptr;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0 || (uint64_t)st.st_size < minSize) {
+		close(fd);
+		return nullptr;
+	}
+
+	// The mapping stays valid after the file is closed
+	void* data = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		return nullptr;
+	}
+
+	size = (size_t)st.st_size;
+	return (const char*)data;
+#endif
+}
+
+static void unmap_file(const char* data, size_t size)
+{
+#if defined(_WIN32)
+	UnmapViewOfFile(data);
+#else
+	munmap((void*)data, size);
+#endif
+}
+
+// FNV-1a, which is stable between runs and platforms
+static uint64_t snapshot_hash(std::string_view key)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (char c : key) {
+		hash ^= (uint8_t)c;
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Hash tables are kept at most half full
+static size_t snapshot_buckets(size_t count)
+{
+	if (count == 0) {
+		return 0;
+	}
+
+	size_t ret = 1;
+	while (ret < count * 2) {
+		ret *= 2;
+	}
+	return ret;
+}
+
+ccpp::snapshot::snapshot()
+{
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+
+	m_defines = nullptr;
+	m_defineCount = 0;
+	m_defineBuckets = 0;
+
+	m_files = nullptr;
+	m_fileCount = 0;
+	m_fileBuckets = 0;
+}
+
+ccpp::snapshot::~snapshot()
+{
+	close();
+}
+
+void ccpp::snapshot::write(std::string &out, const config &cfg, prefetcher* files)
+{
+	write_to(out, cfg, files);
+}
+
+template<typename TString>
+void ccpp::snapshot::write_to(TString &out, const config &cfg, prefetcher* files)
+{
+	typedef std::pair<std::string_view, std::string_view> item;
+	std::vector<item, stl_allocator<item>> defines(stl_allocator<item>(cfg.m_allocator));
+	std::vector<item, stl_allocator<item>> contents(stl_allocator<item>(cfg.m_allocator));
+
+	for (const config::define &def : cfg.m_defines) {
+		if (def.second != nullptr) {
+			defines.emplace_back(def.first, def.second);
+		}
+	}
+
+	// Definitions of the config's own snapshot, unless the config removed them
+	const snapshot* base = cfg.m_snapshot;
+	for (size_t i = 0; base != nullptr && i < base->m_defineBuckets; i++) {
+		const entry &e = base->m_defines[i];
+		std::string_view name(base->m_data + e.offset, (size_t)e.key_size);
+		if (e.offset != 0 && cfg.m_defines.find(name) == cfg.m_defines.end()) {
+			defines.emplace_back(name, std::string_view(name.data() + name.size() + 1, (size_t)e.value_size));
+		}
+	}
+
+	// The files are only referred to while the prefetcher is locked
+	std::unique_lock<std::mutex> lock;
+	if (files != nullptr) {
+		lock = std::unique_lock<std::mutex>(files->m_mutex);
+		files->m_idle.wait(lock, [files]() { return files->m_jobs.empty() && files->m_reading == 0; });
+
+		for (const auto &file : files->m_files) {
+			const std::optional<std::string> &content = file.second.get();
+			if (content) {
+				contents.emplace_back(file.first, *content);
+			}
+		}
+	}
+
+	size_t start = out.size();
+
+	header h;
+	memcpy(h.magic, "CCPP", 4);
+	h.version = version;
+	h.byte_order = 0x01020304;
+	h.entry_size = sizeof(entry);
+
+	h.define_count = defines.size();
+	h.define_buckets = snapshot_buckets(defines.size());
+	h.define_table = sizeof(header);
+
+	h.file_count = contents.size();
+	h.file_buckets = snapshot_buckets(contents.size());
+	h.file_table = h.define_table + h.define_buckets * sizeof(entry);
+
+	// The tables start out empty and the strings follow them
+	out.resize(start + h.file_table + h.file_buckets * sizeof(entry), '\0');
+
+	auto add = [&out, start](uint64_t table, uint64_t buckets, const item &it) {
+		entry e;
+		e.hash = snapshot_hash(it.first);
+		e.offset = out.size() - start;
+		e.key_size = it.first.size();
+		e.value_size = it.second.size();
+
+		out.append(it.first.data(), it.first.size());
+		out += '\0';
+		out.append(it.second.data(), it.second.size());
+		out += '\0';
+
+		size_t index = (size_t)(e.hash & (buckets - 1));
+		while (true) {
+			char* p = &out[start + table + index * sizeof(entry)];
+
+			uint64_t offset;
+			memcpy(&offset, p + offsetof(entry, offset), sizeof(offset));
+			if (offset == 0) {
+				memcpy(p, &e, sizeof(entry));
+				break;
+			}
+			index = (index + 1) & (buckets - 1);
+		}
+	};
+
+	for (const item &it : defines) {
+		add(h.define_table, h.define_buckets, it);
+	}
+	for (const item &it : contents) {
+		add(h.file_table, h.file_buckets, it);
+	}
+
+	h.size = out.size() - start;
+	memcpy(&out[start], &h, sizeof(header));
+}
+
+bool ccpp::snapshot::save(const char* path, const config &cfg, prefetcher* files)
+{
+	// Build the snapshot with the config's allocator
+	std::basic_string<char, std::char_traits<char>, stl_allocator<char>> data(stl_allocator<char>(cfg.m_allocator));
+	write_to(data, cfg, files);
+
+	FILE* fh = fopen(path, "wb");
+	if (fh == nullptr) {
+		return false;
+	}
+
+	bool ret = (fwrite(data.data(), 1, data.size(), fh) == data.size());
+	fclose(fh);
+	return ret;
+}
+
+bool ccpp::snapshot::load(const char* path)
+{
+	close();
+
+	size_t size;
+	const char* data = map_file(path, sizeof(header), size);
+	if (data == nullptr) {
+		return false;
+	}
+
+	if (!load(data, size)) {
+		unmap_file(data, size);
+		return false;
+	}
+
+	m_mapped = true;
+	return true;
+}
+
+bool ccpp::snapshot::load(const void* data, size_t size)
+{
+	close();
+
+	// The tables are used right where they are
+	if (size < sizeof(header) || (uintptr_t)data % alignof(entry) != 0) {
+		return false;
+	}
+
+	header h;
+	memcpy(&h, data, sizeof(header));
+
+	if (memcmp(h.magic, "CCPP", 4) || h.version != version || h.byte_order != 0x01020304 || h.entry_size != sizeof(entry) || h.size != size) {
+		return false;
+	}
+
+	// Make sure nothing points outside of the snapshot, so it doesn't have to be checked when it's used
+	auto validTable = [size](uint64_t table, uint64_t buckets, uint64_t count) {
+		if ((buckets & (buckets - 1)) != 0 || count > buckets || buckets > size / sizeof(entry)) {
+			return false;
+		}
+		return table % alignof(entry) == 0 && table >= sizeof(header) && table <= size - buckets * sizeof(entry);
+	};
+	if (!validTable(h.define_table, h.define_buckets, h.define_count) || !validTable(h.file_table, h.file_buckets, h.file_count)) {
+		return false;
+	}
+
+	// Keys and values must be NUL-terminated, and a table needs an empty bucket to end a lookup
+	auto validEntries = [data, size](uint64_t table, uint64_t buckets) {
+		const char* bytes = (const char*)data;
+		const entry* entries = (const entry*)(bytes + table);
+		size_t used = 0;
+		for (size_t i = 0; i < buckets; i++) {
+			const entry &e = entries[i];
+			if (e.offset == 0) {
+				continue;
+			}
+			if (e.offset > size || e.key_size > size || e.value_size > size || e.offset + e.key_size + e.value_size + 2 > size) {
+				return false;
+			}
+			if (bytes[e.offset + e.key_size] != '\0' || bytes[e.offset + e.key_size + 1 + e.value_size] != '\0') {
+				return false;
+			}
+			used++;
+		}
+		return used < buckets || buckets == 0;
+	};
+	if (!validEntries(h.define_table, h.define_buckets) || !validEntries(h.file_table, h.file_buckets)) {
+		return false;
+	}
+
+	m_data = (const char*)data;
+	m_size = size;
+
+	m_defines = (const entry*)(m_data + h.define_table);
+	m_defineCount = (size_t)h.define_count;
+	m_defineBuckets = (size_t)h.define_buckets;
+
+	m_files = (const entry*)(m_data + h.file_table);
+	m_fileCount = (size_t)h.file_count;
+	m_fileBuckets = (size_t)h.file_buckets;
+	return true;
+}
+
+void ccpp::snapshot::close()
+{
+	if (m_mapped) {
+		unmap_file(m_data, m_size);
+	}
+
+	m_data = nullptr;
+	m_size = 0;
+	m_mapped = false;
+
+	m_defines = nullptr;
+	m_defineCount = 0;
+	m_defineBuckets = 0;
+
+	m_files = nullptr;
+	m_fileCount = 0;
+	m_fileBuckets = 0;
+}
+
+bool ccpp::snapshot::is_loaded() const
+{
+	return m_data != nullptr;
+}
+
+size_t ccpp::snapshot::define_count() const
+{
+	return m_defineCount;
+}
+
+const char* ccpp::snapshot::get_define(std::string_view name) const
+{
+	const entry* e = find(m_defines, m_defineBuckets, name);
+	if (e == nullptr) {
+		return nullptr;
+	}
+	return m_data + e->offset + e->key_size + 1;
+}
+
+size_t ccpp::snapshot::file_count() const
+{
+	return m_fileCount;
+}
+
+bool ccpp::snapshot::get_file(std::string_view path, std::string_view &content) const
+{
+	const entry* e = find(m_files, m_fileBuckets, path);
+	if (e == nullptr) {
+		return false;
+	}
+	content = std::string_view(m_data + e->offset + e->key_size + 1, (size_t)e->value_size);
+	return true;
+}
+
+const ccpp::snapshot::entry* ccpp::snapshot::find(const entry* table, size_t buckets, std::string_view key) const
+{
+	if (buckets == 0) {
+		return nullptr;
+	}
+
+	uint64_t hash = snapshot_hash(key);
+	size_t index = (size_t)(hash & (buckets - 1));
+
+	for (size_t i = 0; i < buckets; i++) {
+		const entry &e = table[index];
+		if (e.offset == 0) {
+			return nullptr;
+		}
+		if (e.hash == hash && e.key_size == key.size() && !memcmp(m_data + e.offset, key.data(), key.size())) {
+			return &e;
+		}
+		index = (index + 1) & (buckets - 1);
+	}
+	return nullptr;
+}
+
+// Nanoseconds since the epoch, which is also what last write times of files are converted to
+static uint64_t cache_now()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// Entries are named after their key, as 16 hexadecimal digits followed by ".ccpp"
+static bool cache_parse_name(const char* name, uint64_t &key)
+{
+	if (strlen(name) != 21 || strcmp(name + 16, ".ccpp")) {
+		return false;
+	}
+
+	key = 0;
+	for (int i = 0; i < 16; i++) {
+		char c = name[i];
+		if (c >= '0' && c <= '9') {
+			key = (key << 4) | (uint64_t)(c - '0');
+		} else if (c >= 'a' && c <= 'f') {
+			key = (key << 4) | (uint64_t)(c - 'a' + 10);
+		} else {
+			return false;
+		}
+	}
+	return true;
+}
+
+ccpp::cache::view::view()
+{
+	m_data = nullptr;
+	m_size = 0;
+}
+
+ccpp::cache::view::view(view &&move)
+{
+	m_data = move.m_data;
+	m_size = move.m_size;
+	move.m_data = nullptr;
+	move.m_size = 0;
+}
+
+ccpp::cache::view::~view()
+{
+	close();
+}
+
+ccpp::cache::view &ccpp::cache::view::operator=(view &&move)
+{
+	if (this != &move) {
+		close();
+		m_data = move.m_data;
+		m_size = move.m_size;
+		move.m_data = nullptr;
+		move.m_size = 0;
+	}
+	return *this;
+}
+
+const char* ccpp::cache::view::data() const
+{
+	if (m_data == nullptr) {
+		return nullptr;
+	}
+	return m_data + sizeof(file_header);
+}
+
+size_t ccpp::cache::view::size() const
+{
+	if (m_data == nullptr) {
+		return 0;
+	}
+	return m_size - sizeof(file_header);
+}
+
+void ccpp::cache::view::close()
+{
+	if (m_data != nullptr) {
+		unmap_file(m_data, m_size);
+		m_data = nullptr;
+		m_size = 0;
+	}
+}
+
+ccpp::cache::cache(const char* dir, uint64_t maxSize, allocator* alloc)
+	: m_dir(dir, stl_allocator<char>(resolve_allocator(alloc)))
+	, m_maxSize(maxSize)
+	, m_entries(stl_allocator<std::pair<const uint64_t, entry>>(resolve_allocator(alloc)))
+	, m_size(0)
+	, m_tempCounter(0)
+{
+	// Pick up the entries of earlier runs, with their last use from when they were last written or read
+#if defined(_WIN32)
+	CreateDirectoryA(dir, nullptr);
+
+	path_string pattern = m_dir;
+	pattern += "/*.ccpp";
+
+	WIN32_FIND_DATAA find;
+	HANDLE handle = FindFirstFileA(pattern.c_str(), &find);
+	if (handle != INVALID_HANDLE_VALUE) {
+		do {
+			uint64_t key;
+			if (!cache_parse_name(find.cFileName, key)) {
+				continue;
+			}
+
+			uint64_t writeTime = ((uint64_t)find.ftLastWriteTime.dwHighDateTime << 32) | find.ftLastWriteTime.dwLowDateTime;
+
+			entry e;
+			e.size = ((uint64_t)find.nFileSizeHigh << 32) | find.nFileSizeLow;
+			e.last_use = (writeTime - 116444736000000000ull) * 100;
+			m_entries.emplace(key, e);
+			m_size += e.size;
+		} while (FindNextFileA(handle, &find));
+		FindClose(handle);
+	}
+#else
+	mkdir(dir, 0755);
+
+	DIR* d = opendir(dir);
+	if (d != nullptr) {
+		struct dirent* ent;
+		while ((ent = readdir(d)) != nullptr) {
+			uint64_t key;
+			struct stat st;
+			if (!cache_parse_name(ent->d_name, key) || stat(entry_path(key).c_str(), &st) != 0) {
+				continue;
+			}
+
+			entry e;
+			e.size = (uint64_t)st.st_size;
+			e.last_use = (uint64_t)st.st_mtime * 1000000000ull;
+			m_entries.emplace(key, e);
+			m_size += e.size;
+		}
+		closedir(d);
+	}
+#endif
+
+	evict();
+}
+
+uint64_t ccpp::cache::key(const char* buffer, size_t len, uint64_t fingerprint)
+{
+	uint64_t prefix[2] = { version, fingerprint };
+
+	hasher h;
+	h.update(prefix, sizeof(prefix));
+	h.update(buffer, len);
+	return h.digest();
+}
+
+bool ccpp::cache::get(uint64_t key, view &out)
+{
+	path_string path = entry_path(key);
+
+	size_t size;
+	const char* data = map_file(path.c_str(), sizeof(file_header), size);
+	if (data == nullptr) {
+		return false;
+	}
+
+	file_header header;
+	memcpy(&header, data, sizeof(file_header));
+	if (memcmp(header.magic, "CCPC", 4) || header.version != version || header.key != key || header.size != size - sizeof(file_header)) {
+		unmap_file(data, size);
+		return false;
+	}
+
+	// Remember the use for the next run as well
+#if defined(_WIN32)
+	_utime(path.c_str(), nullptr);
+#else
+	utime(path.c_str(), nullptr);
+#endif
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+
+		auto it = m_entries.find(key);
+		if (it == m_entries.end()) {
+			// Written by someone else since the cache was opened
+			entry e;
+			e.size = size;
+			e.last_use = cache_now();
+			m_entries.emplace(key, e);
+			m_size += size;
+		} else {
+			it->second.last_use = cache_now();
+		}
+	}
+
+	out.close();
+	out.m_data = data;
+	out.m_size = size;
+	return true;
+}
+
+bool ccpp::cache::put(uint64_t key, const char* output, size_t len)
+{
+	path_string path = entry_path(key);
+
+	uint64_t tempCounter;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		tempCounter = m_tempCounter++;
+	}
+
+	// Other processes may be writing the same entry, so the temporary file is unique to this one
+#if defined(_WIN32)
+	unsigned long long pid = GetCurrentProcessId();
+#else
+	unsigned long long pid = (unsigned long long)getpid();
+#endif
+	char suffix[64];
+	snprintf(suffix, sizeof(suffix), ".%llx.%llx.tmp", pid, (unsigned long long)tempCounter);
+
+	path_string tempPath = path;
+	tempPath += suffix;
+
+	FILE* fh = fopen(tempPath.c_str(), "wb");
+	if (fh == nullptr) {
+		return false;
+	}
+
+	file_header header;
+	memcpy(header.magic, "CCPC", 4);
+	header.version = version;
+	header.key = key;
+	header.size = len;
+
+	bool ok = (fwrite(&header, sizeof(file_header), 1, fh) == 1);
+	if (ok && len > 0) {
+		ok = (fwrite(output, 1, len, fh) == len);
+	}
+	ok = (fclose(fh) == 0) && ok;
+
+	// Renaming replaces any older entry at once, so readers see either all or none of it
+	if (ok) {
+#if defined(_WIN32)
+		ok = (MoveFileExA(tempPath.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING) != 0);
+#else
+		ok = (rename(tempPath.c_str(), path.c_str()) == 0);
+#endif
+	}
+	if (!ok) {
+		remove(tempPath.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	entry e;
+	e.size = sizeof(file_header) + len;
+	e.last_use = cache_now();
+
+	auto it = m_entries.find(key);
+	if (it != m_entries.end()) {
+		m_size -= it->second.size;
+		it->second = e;
+	} else {
+		m_entries.emplace(key, e);
+	}
+	m_size += e.size;
+
+	evict();
+	return true;
+}
+
+void ccpp::cache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	for (const auto &it : m_entries) {
+		remove(entry_path(it.first).c_str());
+	}
+	m_entries.clear();
+	m_size = 0;
+}
+
+uint64_t ccpp::cache::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
+
+ccpp::cache::path_string ccpp::cache::entry_path(uint64_t key) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llx.ccpp", (unsigned long long)key);
+
+	path_string ret = m_dir;
+	ret += name;
+	return ret;
+}
+
+void ccpp::cache::evict()
+{
+	if (m_maxSize == 0 || m_size <= m_maxSize) {
+		return;
+	}
+
+	typedef std::pair<uint64_t, uint64_t> use;
+	std::vector<use, stl_allocator<use>> uses(stl_allocator<use>(m_entries.get_allocator()));
+	uses.reserve(m_entries.size());
+	for (const auto &it : m_entries) {
+		uses.emplace_back(it.second.last_use, it.first);
+	}
+	std::sort(uses.begin(), uses.end());
+
+	// Make some room below the maximum, so not every put has to evict
+	uint64_t target = m_maxSize - m_maxSize / 8;
+	for (size_t i = 0; i < uses.size() && m_size > target; i++) {
+		auto it = m_entries.find(uses[i].second);
+		remove(entry_path(it->first).c_str());
+		m_size -= it->second.size;
+		m_entries.erase(it);
+	}
+}
+
+ccpp::session::scope_stack::scope_stack(allocator* alloc)
+{
+	m_allocator = alloc;
+	m_scopes = m_inline;
+	m_size = 0;
+	m_capacity = CCPP_INLINE_SCOPES;
+}
+
+ccpp::session::scope_stack::~scope_stack()
+{
+	if (m_scopes != m_inline) {
+		m_allocator->deallocate(m_scopes, m_capacity);
+	}
+}
+
+void ccpp::session::scope_stack::push(uint8_t scope)
+{
+	if (m_size == m_capacity) {
+		grow();
+	}
+	m_scopes[m_size++] = scope;
+}
+
+void ccpp::session::scope_stack::pop()
+{
+	CCPP_ASSERT(m_size > 0);
+	m_size--;
+}
+
+void ccpp::session::scope_stack::set_top(uint8_t scope)
+{
+	CCPP_ASSERT(m_size > 0);
+	m_scopes[m_size - 1] = scope;
+}
+
+void ccpp::session::scope_stack::grow()
+{
+	// Only reached with pathologically deep nesting
+	size_t newCapacity = m_capacity * 2;
+	uint8_t* newScopes = (uint8_t*)m_allocator->allocate(newCapacity);
+	memcpy(newScopes, m_scopes, m_size);
+
+	if (m_scopes != m_inline) {
+		m_allocator->deallocate(m_scopes, m_capacity);
+	}
+
+	m_scopes = newScopes;
+	m_capacity = newCapacity;
+}
+
+ccpp::config::config(allocator* alloc)
+	: m_allocator(resolve_allocator(alloc))
+	, m_defines(stl_allocator<define>(m_allocator))
+{
+	m_frozen = false;
+
+	m_snapshot = nullptr;
+	m_prefetcher = nullptr;
+
+	m_languageAware = false;
+	m_outputMode = output_mode::in_place;
+	m_stripComments = false;
+}
+
+ccpp::config::config(const config &copy)
+	: config(copy.m_allocator)
+{
+	m_defines.reserve(copy.m_defines.size());
+	for (const define &def : copy.m_defines) {
+		if (def.second == nullptr) {
+			m_defines.insert(def);
+		} else {
+			m_defines.insert(make_define(def.first, def.second));
+		}
+	}
+	m_snapshot = copy.m_snapshot;
+
+	m_languageAware = copy.m_languageAware;
+	m_outputMode = copy.m_outputMode;
+	m_stripComments = copy.m_stripComments;
+
+	m_includeCallback = copy.m_includeCallback;
+	m_commandCallback = copy.m_commandCallback;
+
+	m_includeLoadCallback = copy.m_includeLoadCallback;
+	m_includeReadyCallback = copy.m_includeReadyCallback;
+
+	m_prefetcher = copy.m_prefetcher;
+}
+
+ccpp::config::~config()
+{
+	for (const define &def : m_defines) {
+		// Removed definitions point into the snapshot
+		if (def.second != nullptr) {
+			free_define(def);
+		}
+	}
+}
+
+void ccpp::config::freeze()
+{
+	m_frozen = true;
+}
+
+bool ccpp::config::is_frozen() const
+{
+	return m_frozen;
+}
+
+ccpp::allocator* ccpp::config::get_allocator() const
+{
+	return m_allocator;
+}
+
+uint64_t ccpp::config::fingerprint() const
+{
+	// Definitions are summed up, so their order doesn't matter
+	uint64_t defines = 0;
+	uint64_t count = 0;
+	auto add = [&defines, &count](std::string_view name, std::string_view value) {
+		hasher h;
+		// The name is hashed with its terminator, so names and values can't run into each other
+		h.update(name.data(), name.size() + 1);
+		h.update(value);
+		defines += h.digest();
+		count++;
+	};
+
+	for (const define &def : m_defines) {
+		if (def.second != nullptr) {
+			add(def.first, def.second);
+		}
+	}
+
+	const snapshot* base = m_snapshot;
+	for (size_t i = 0; base != nullptr && i < base->m_defineBuckets; i++) {
+		const snapshot::entry &e = base->m_defines[i];
+		std::string_view name(base->m_data + e.offset, (size_t)e.key_size);
+		if (e.offset != 0 && m_defines.find(name) == m_defines.end()) {
+			add(name, std::string_view(name.data() + name.size() + 1, (size_t)e.value_size));
+		}
+	}
+
+	// The directive character is global, but changes the output all the same
+	uint64_t data[6] = { defines, count, m_languageAware, (uint64_t)m_outputMode, m_stripComments, (uint64_t)(uint8_t)character };
+	return hasher::hash(data, sizeof(data));
+}
+
+void ccpp::config::add_define(const char* name, const char* value)
+{
+	add_define(std::string_view(name), (value != nullptr) ? std::string_view(value) : std::string_view());
+}
+
+void ccpp::config::add_define(std::string_view name, std::string_view value)
+{
+	if (!can_change()) {
+		return;
+	}
+
+	if (has_define(name)) {
+		CCPP_ERROR("Definition \"%.*s\" already exists!", (int)name.size(), name.data());
+		return;
+	}
+
+	// Replaces the removal of a definition of the snapshot, if there is one
+	m_defines.erase(name);
+	m_defines.insert(make_define(name, value));
+}
+
+void ccpp::config::remove_define(const char* name)
+{
+	remove_define(std::string_view(name));
+}
+
+void ccpp::config::remove_define(std::string_view name)
+{
+	if (!can_change()) {
+		return;
+	}
+
+	const char* value = get_define(name);
+	if (value == nullptr) {
+		CCPP_ERROR("Couldn't undefine \"%.*s\" because it does not exist!", (int)name.size(), name.data());
+		return;
+	}
+
+	auto it = m_defines.find(name);
+	if (it != m_defines.end()) {
+		// The name may be stored in the definition itself, so the snapshot is asked first
+		const char* snapshotValue = (m_snapshot != nullptr) ? m_snapshot->get_define(name) : nullptr;
+
+		define def = *it;
+		m_defines.erase(it);
+		free_define(def);
+
+		// A definition of the snapshot under it stays removed
+		if (snapshotValue != nullptr) {
+			m_defines.emplace(define_name(snapshotValue, name.size()), nullptr);
+		}
+		return;
+	}
+
+	// Remember the removal of a definition of the snapshot
+	m_defines.emplace(define_name(value, name.size()), nullptr);
+}
+
+bool ccpp::config::has_define(const char* name) const
+{
+	return has_define(std::string_view(name));
+}
+
+bool ccpp::config::has_define(std::string_view name) const
+{
+	return get_define(name) != nullptr;
+}
+
+const char* ccpp::config::get_define(const char* name) const
+{
+	return get_define(std::string_view(name));
+}
+
+const char* ccpp::config::get_define(std::string_view name) const
+{
+	auto it = m_defines.find(name);
+	if (it != m_defines.end()) {
+		return it->second;
+	}
+	if (m_snapshot != nullptr) {
+		return m_snapshot->get_define(name);
+	}
+	return nullptr;
+}
+
+void ccpp::config::set_include_callback(include_callback_t callback)
+{
+	if (can_change()) {
+		m_includeCallback = callback;
+	}
+}
+
+void ccpp::config::set_command_callback(command_callback_t callback)
+{
+	if (can_change()) {
+		m_commandCallback = callback;
+	}
+}
+
+void ccpp::config::set_async_include_callbacks(include_load_callback_t load, include_ready_callback_t ready)
+{
+	if (can_change()) {
+		m_includeLoadCallback = load;
+		m_includeReadyCallback = ready;
+	}
+}
+
+void ccpp::config::set_include_prefetcher(prefetcher* prefetcher)
+{
+	if (can_change()) {
+		m_prefetcher = prefetcher;
+	}
+}
+
+void ccpp::config::set_snapshot(const snapshot* snapshot)
+{
+	if (can_change()) {
+		m_snapshot = snapshot;
+	}
+}
+
+void ccpp::config::set_language_aware(bool enabled)
+{
+	if (can_change()) {
+		m_languageAware = enabled;
+	}
+}
+
+void ccpp::config::set_output_mode(output_mode mode)
+{
+	if (can_change()) {
+		m_outputMode = mode;
+	}
+}
+
+void ccpp::config::set_strip_comments(bool strip)
+{
+	if (can_change()) {
+		m_stripComments = strip;
+	}
+}
+
+bool ccpp::config::can_change()
+{
+	if (m_frozen) {
+		CCPP_ERROR("Can't change a config after it has been frozen!");
+		return false;
+	}
+	return true;
+}
+
+ccpp::config::define ccpp::config::make_define(std::string_view name, std::string_view value) const
+{
+	// Name and value share a single allocation
+	char* p = (char*)m_allocator->allocate(name.size() + 1 + value.size() + 1);
+	memcpy(p, name.data(), name.size());
+	p[name.size()] = '\0';
+
+	char* pValue = p + name.size() + 1;
+	if (value.size() > 0) {
+		memcpy(pValue, value.data(), value.size());
+	}
+	pValue[value.size()] = '\0';
+
+	return define(std::string_view(p, name.size()), pValue);
+}
+
+std::string_view ccpp::config::define_name(const char* value, size_t lenName)
+{
+	// Both the config and the snapshot store the name right before the value
+	return std::string_view(value - lenName - 1, lenName);
+}
+
+void ccpp::config::free_define(const define &def) const
+{
+	size_t size = def.first.size() + 1 + strlen(def.second) + 1;
+	m_allocator->deallocate((void*)def.first.data(), size);
+}
+
+// Buffers are only processed in parallel when every thread gets at least this much of it
+static const size_t parallel_min_chunk = 1024 * 1024;
+
+// Calls work(i) for every i below count at the same time, with the last one on this thread
+template<typename TWork>
+static void run_parallel(ccpp::allocator* alloc, size_t count, const TWork &work)
+{
+	std::vector<std::thread, ccpp::stl_allocator<std::thread>> threads{ ccpp::stl_allocator<std::thread>(alloc) };
+	threads.reserve(count - 1);
+	for (size_t i = 0; i + 1 < count; i++) {
+		threads.emplace_back([&work, i]() {
+			work(i);
+		});
+	}
+
+	work(count - 1);
+
+	for (std::thread &thread : threads) {
+		thread.join();
+	}
+}
+
+// Output is fed to the output hasher in parts of at least this size, while it's still in the cache
+static const size_t output_hash_chunk = 4096;
+
+ccpp::session::session(const config &cfg)
+	: m_config(&cfg)
+	, m_allocator(cfg.m_allocator)
+	, m_defines(stl_allocator<define>(m_allocator))
+	, m_stack(m_allocator)
+	, m_erased(stl_allocator<erased_part>(m_allocator))
+	, m_pendingIncludes(stl_allocator<pending_include>(m_allocator))
+	, m_pendingPaths(stl_allocator<char>(m_allocator))
+{
+	m_p = nullptr;
+	m_pEnd = nullptr;
+
+	m_lineAt = nullptr;
+	m_line = 0;
+
+	m_languageAware = false;
+	m_outputMode = output_mode::in_place;
+	m_stripComments = false;
+
+	m_out = nullptr;
+	m_keep = nullptr;
+
+	m_minifyLine = 0;
+	m_minifyContent = false;
+	m_minifySpace = false;
+
+	m_lineMap = nullptr;
+	m_lineMapFile = 0;
+	m_lineMapLine = 0;
+
+	m_stats = nullptr;
+	m_tracer = nullptr;
+
+	m_outputHasher = nullptr;
+	m_hashed = nullptr;
+
+	m_dependencies = nullptr;
+
+	m_recordErased = false;
+}
+
+ccpp::session::~session()
+{
+	clear_defines();
+}
+
+void ccpp::session::add_define(const char* name, const char* value)
+{
+	add_define(std::string_view(name), (value != nullptr) ? std::string_view(value) : std::string_view());
+}
+
+void ccpp::session::add_define(std::string_view name, std::string_view value)
+{
+	if (has_define(name)) {
+		CCPP_ERROR("Definition \"%.*s\" already exists!", (int)name.size(), name.data());
+		return;
+	}
+
+	// Replaces the removal of a definition of the config, if there is one
+	m_defines.erase(name);
+	m_defines.insert(m_config->make_define(name, value));
+}
+
+void ccpp::session::remove_define(const char* name)
+{
+	remove_define(std::string_view(name));
+}
+
+void ccpp::session::remove_define(std::string_view name)
+{
+	auto it = m_defines.find(name);
+	const char* configValue = m_config->get_define(name);
+
+	bool defined = (it != m_defines.end()) ? (it->second != nullptr) : (configValue != nullptr);
+	if (!defined) {
+		CCPP_ERROR("Couldn't undefine \"%.*s\" because it does not exist!", (int)name.size(), name.data());
+		return;
+	}
+
+	if (it != m_defines.end()) {
+		define def = *it;
+		m_defines.erase(it);
+		m_config->free_define(def);
+	}
+
+	// Remember the removal if the config defines it
+	if (configValue != nullptr) {
+		m_defines.emplace(config::define_name(configValue, name.size()), nullptr);
+	}
+}
+
+bool ccpp::session::has_define(const char* name) const
+{
+	return has_define(std::string_view(name));
+}
+
+bool ccpp::session::has_define(std::string_view name) const
+{
+	return get_define(name) != nullptr;
+}
+
+const char* ccpp::session::get_define(const char* name) const
+{
+	return get_define(std::string_view(name));
+}
+
+const char* ccpp::session::get_define(std::string_view name) const
+{
+	if (!m_defines.empty()) {
+		auto it = m_defines.find(name);
+		if (it != m_defines.end()) {
+			return it->second;
+		}
+	}
+	return m_config->get_define(name);
+}
+
+void ccpp::session::scan_dependencies(const char* buffer, size_t len, dependencies &deps)
+{
+	if (m_p != nullptr) {
+		CCPP_ERROR("Illegal attempt of preprocessor usage while not finished preprocessing!");
+		return;
+	}
+
+	// Nothing is written, and there are no output lines to map
+	line_map* lineMap = m_lineMap;
+	m_lineMap = nullptr;
+	m_dependencies = &deps;
+
+	process((char*)buffer, len);
+
+	m_dependencies = nullptr;
+	m_lineMap = lineMap;
+}
+
+void ccpp::session::clear_defines()
+{
+	for (const define &def : m_defines) {
+		// Removed definitions point into the config or its snapshot
+		if (def.second != nullptr) {
+			m_config->free_define(def);
+		}
+	}
+	m_defines.clear();
+}
+
+void ccpp::session::set_line_map(line_map* map, uint32_t file)
+{
+	m_lineMap = map;
+	m_lineMapFile = file;
+}
+
+void ccpp::session::set_stats(stats* stats)
+{
+	m_stats = stats;
+}
+
+void ccpp::session::set_tracer(tracer* tracer)
+{
+	m_tracer = tracer;
+}
+
+void ccpp::session::set_output_hasher(hasher* hasher)
+{
+	m_outputHasher = hasher;
+}
+
+size_t ccpp::session::process(char* buffer)
+{
+	return process(buffer, strlen(buffer));
+}
+
+size_t ccpp::session::process(char* buffer, size_t len)
+{
+	if (m_p != nullptr) {
+		CCPP_ERROR("Illegal attempt of preprocessor usage while not finished preprocessing!");
+		return len;
+	}
+
+	begin_process(buffer, len);
+
+	// Minifying needs to know where strings are to leave them alone
+	bool languageAware = m_languageAware || m_outputMode == output_mode::minify;
+
+	line_map_resume(1);
+
+	// Without any directives there is nothing to do, unless minifying or still inside of a scope
+	if (m_outputMode != output_mode::minify && m_stack.size() == 0 && scan_line_start(buffer, m_pEnd, character) == m_pEnd) {
+		CCPP_STAT(no_directives = 1);
+		m_p = m_pEnd;
+	}
+
+	// The innermost scope, which is kept up to date whenever the stack changes
+	uint8_t scope = m_stack.top();
+
+	while (m_p < m_pEnd) {
+		bool isErasing = (scope & Scope_Erasing);
+
+		// Directives are only recognized at the start of a line
+		if (*m_p == character && (m_p == buffer || m_p[-1] == '\n')) {
+			directive(scope);
+			continue;
+		}
+
+		if (!languageAware) {
+			// Nothing else can happen until the next directive
+			char* textEnd = scan_char(m_p, m_pEnd, '\n');
+			if (textEnd < m_pEnd) {
+				textEnd = (char*)scan_line_start(textEnd + 1, m_pEnd, character);
+			}
+			if (isErasing) {
+				erase_text(m_p, textEnd);
+			}
+			m_p = textEnd;
+			continue;
+		}
+
+		if (skip_region(isErasing)) {
+			continue;
+		}
+
+		// Comments or strings might start anywhere on the line
+		if (isErasing) {
+			erase_text(m_p, m_p + 1);
+		}
+		m_p++;
+	}
+
+	finish_includes();
+
+	CCPP_STAT(bytes_passed = m_stats->bytes_scanned - m_stats->bytes_erased - m_stats->bytes_directives);
+
+	size_t lenOut = len;
+	if (m_outputMode != output_mode::in_place) {
+		// Move the last kept content into place
+		keep(m_pEnd);
+
+		lenOut = m_out - buffer;
+		if (lenOut < len) {
+			buffer[lenOut] = '\0';
+		}
+	}
+
+	return end_process(buffer, lenOut);
+}
+
+size_t ccpp::session::process_parallel(char* buffer, size_t len, size_t threads)
+{
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+	threads = std::min(threads, len / parallel_min_chunk);
+
+	// Comments and strings can only be found from the start, and line maps are written in order
+	bool languageAware = m_config->m_languageAware || m_config->m_outputMode == output_mode::minify;
+	if (threads <= 1 || languageAware || m_lineMap != nullptr || m_dependencies != nullptr || m_p != nullptr) {
+		return process(buffer, len);
+	}
+
+	begin_process(buffer, len);
+
+	struct found_directive
+	{
+		char* p;
+		size_t line;
+	};
+	typedef std::vector<found_directive, stl_allocator<found_directive>> found_list;
+
+	struct chunk
+	{
+		char* p;
+		char* pEnd;
+		size_t lines;
+		found_list directives;
+	};
+	std::vector<chunk, stl_allocator<chunk>> chunks{ stl_allocator<chunk>(m_allocator) };
+	chunks.reserve(threads);
+	for (size_t i = 0; i < threads; i++) {
+		chunks.push_back({ buffer + len * i / threads, buffer + len * (i + 1) / threads, 0, found_list(stl_allocator<found_directive>(m_allocator)) });
+	}
+
+	// Find the directives of every chunk, along with their line within the chunk
+	run_parallel(m_allocator, threads, [&chunks, buffer](size_t i) {
+		chunk &c = chunks[i];
+		const char* counted = c.p;
+
+		for (char* p = c.p; (p = (char*)scan_line_start(p, c.pEnd, character)) < c.pEnd; p++) {
+			// The start of the chunk isn't always the start of a line
+			if (p > buffer && p[-1] != '\n') {
+				continue;
+			}
+			c.lines += scan_count(counted, p, '\n');
+			counted = p;
+			c.directives.push_back({ p, c.lines });
+		}
+		c.lines += scan_count(counted, c.pEnd, '\n');
+	});
+
+	// Handle the directives in order, only recording what to erase
+	m_recordErased = true;
+	m_erased.clear();
+
+	uint8_t scope = m_stack.top();
+	char* textStart = buffer;
+	size_t line = 1;
+
+	for (chunk &c : chunks) {
+		for (const found_directive &d : c.directives) {
+			// The directive before may have run past its line, eg. with a string spanning lines
+			if (d.p < textStart) {
+				continue;
+			}
+
+			if ((scope & Scope_Erasing) && textStart < d.p) {
+				erase_text(textStart, d.p);
+			}
+
+			// The line of the directive is already known
+			m_p = d.p;
+			m_lineAt = d.p;
+			m_line = line + d.line;
+			directive(scope);
+
+			textStart = m_p;
+		}
+		line += c.lines;
+	}
+
+	if ((scope & Scope_Erasing) && textStart < m_pEnd) {
+		erase_text(textStart, m_pEnd);
+	}
+	m_p = m_pEnd;
+	m_lineAt = m_pEnd;
+	m_line = line;
+
+	m_recordErased = false;
+
+	finish_includes();
+
+	CCPP_STAT(bytes_passed = m_stats->bytes_scanned - m_stats->bytes_erased - m_stats->bytes_directives);
+
+	size_t lenOut = len;
+	if (m_outputMode == output_mode::in_place) {
+		// Every thread blanks the erased parts within its own chunk
+		run_parallel(m_allocator, threads, [this, &chunks](size_t i) {
+			const chunk &c = chunks[i];
+
+			auto it = std::lower_bound(m_erased.begin(), m_erased.end(), c.p, [](const erased_part &part, char* p) {
+				return part.pEnd <= p;
+			});
+			for (; it != m_erased.end() && it->p < c.pEnd; it++) {
+				char* p = std::max(it->p, c.p);
+				char* pEnd = std::min(it->pEnd, c.pEnd);
+				overwrite(p, pEnd - p);
+			}
+		});
+
+	} else if (!m_erased.empty()) {
+		// Parts that are kept go where all kept parts before them end
+		struct kept_part
+		{
+			char* p;
+			char* pEnd;
+			size_t out;
+		};
+		std::vector<kept_part, stl_allocator<kept_part>> kept{ stl_allocator<kept_part>(m_allocator) };
+		kept.reserve(m_erased.size() + 1);
+
+		char* p = buffer;
+		lenOut = 0;
+		for (const erased_part &part : m_erased) {
+			if (part.p > p) {
+				kept.push_back({ p, part.p, lenOut });
+				lenOut += part.p - p;
+			}
+			p = part.pEnd;
+		}
+		if (p < m_pEnd) {
+			kept.push_back({ p, m_pEnd, lenOut });
+			lenOut += m_pEnd - p;
+		}
+
+		// Moving the parts within the buffer could overwrite parts other threads haven't moved yet, so
+		// they're gathered into a separate buffer first and copied back after
+		char* out = (char*)m_allocator->allocate(lenOut + 1);
+
+		run_parallel(m_allocator, threads, [&chunks, &kept, out](size_t i) {
+			const chunk &c = chunks[i];
+
+			auto it = std::lower_bound(kept.begin(), kept.end(), c.p, [](const kept_part &part, char* p) {
+				return part.pEnd <= p;
+			});
+			for (; it != kept.end() && it->p < c.pEnd; it++) {
+				char* p = std::max(it->p, c.p);
+				char* pEnd = std::min(it->pEnd, c.pEnd);
+				memcpy(out + it->out + (p - it->p), p, pEnd - p);
+			}
+		});
+
+		run_parallel(m_allocator, threads, [buffer, out, lenOut, threads](size_t i) {
+			size_t start = lenOut * i / threads;
+			size_t end = lenOut * (i + 1) / threads;
+			memcpy(buffer + start, out + start, end - start);
+		});
+
+		m_allocator->deallocate(out, lenOut + 1);
+
+		if (lenOut < len) {
+			buffer[lenOut] = '\0';
+		}
+	}
+
+	m_erased.clear();
+
+	return end_process(buffer, lenOut);
+}
+
+// Sets up the state of a process() run
+void ccpp::session::begin_process(char* buffer, size_t len)
+{
+	m_lineAt = buffer;
+	m_line = 1;
+
+	m_p = buffer;
+	m_pEnd = buffer + len;
+
+	m_out = buffer;
+	m_keep = buffer;
+	m_hashed = buffer;
+
+	m_minifyLine = 1;
+	m_minifyContent = false;
+	m_minifySpace = false;
+
+	m_languageAware = m_config->m_languageAware;
+	m_outputMode = m_config->m_outputMode;
+	m_stripComments = m_config->m_stripComments;
+
+	if (m_dependencies != nullptr) {
+		// Minifying recognizes comments and strings, which decides which directives are seen
+		m_languageAware = m_languageAware || m_outputMode == output_mode::minify;
+		m_outputMode = output_mode::in_place;
+	}
+
+	if (m_stats != nullptr) {
+		memset(m_stats, 0, sizeof(stats));
+	}
+
+	if (m_tracer != nullptr) {
+		m_tracer->begin("process");
+	}
+
+	if (m_config->m_prefetcher != nullptr && m_dependencies == nullptr) {
+		m_config->m_prefetcher->prefetch(buffer, len);
+	}
+	CCPP_STAT(bytes_scanned = len);
+}
+
+// Finishes a process() run, after the output has been written
+size_t ccpp::session::end_process(char* buffer, size_t lenOut)
+{
+	if (m_outputHasher != nullptr && m_dependencies == nullptr) {
+		hash_output(buffer + lenOut);
+	}
+
+	// If there's something left in the stack, there are unclosed commands (missing #endif etc.)
+	if (m_stack.size() > 0) {
+		CCPP_ERROR("%d preprocessor scope(s) left unclosed at end of file (did you forget \"#endif\"?)", (int)m_stack.size());
+	}
+
+	// The last line only counts if it's not empty
+	if (m_outputMode == output_mode::minify) {
+		if (m_lineMap != nullptr && m_minifyContent) {
+			m_lineMap->advance(1);
+		}
+	} else if (m_lineMap != nullptr) {
+		size_t line = line_at(m_pEnd);
+		if (lenOut > 0 && buffer[lenOut - 1] != '\n') {
+			line++;
+		}
+		line_map_flush(line);
+	}
+
+	m_p = nullptr;
+	m_pEnd = nullptr;
+	m_out = nullptr;
+	m_keep = nullptr;
+	m_hashed = nullptr;
+
+	if (m_tracer != nullptr) {
+		m_tracer->end();
+	}
+
+	return lenOut;
+}
+
+// Handles the directive at m_p, which is at the start of a line
+void ccpp::session::directive(uint8_t &scope)
+{
+	bool isErasing = (scope & Scope_Erasing);
+	bool isDeep = (scope & Scope_Deep);
+
+	char* commandStart = m_p++;
+
+	// Expect a command word
+	size_t lenCommand = lex_expect(m_p, m_pEnd, ELexType::Word);
+	if (lenCommand == 0) {
+		return;
+	}
+
+	std::string_view wordCommand(m_p, lenCommand);
+
+	m_p += lenCommand;
+
+	if (wordCommand == "define") {
+		// #define <word>
+		CCPP_STAT(directives[directive_define]++);
+
+		if (isErasing) {
+			// Just consume the line if we're erasing
+			consume_line();
+
+		} else {
+			// Expect some whitespace
+			size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
+			if (lenCommandWhitespace == 0) {
+				return;
+			}
+			m_p += lenCommandWhitespace;
+
+			// Expect a define word
+			size_t lenDefine = lex_expect(m_p, m_pEnd, ELexType::Word);
+			if (lenDefine == 0) {
+				return;
+			}
+
+			std::string_view wordDefine(m_p, lenDefine);
+			m_p += lenDefine;
+
+			// Optional value, which is the rest of the line
+			std::string_view wordValue;
+
+			ELexType typeValue;
+			size_t lenValueWhitespace = lex(m_p, m_pEnd, typeValue);
+			if (typeValue == ELexType::Whitespace) {
+				char* valueStart = m_p + lenValueWhitespace;
+				char* valueEnd = valueStart;
+				while (valueEnd < m_pEnd && *valueEnd != '\r' && *valueEnd != '\n') {
+					valueEnd++;
+				}
+				m_p = valueEnd;
+
+				// Trim trailing whitespace
+				while (valueEnd > valueStart && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t')) {
+					valueEnd--;
+				}
+
+				wordValue = std::string_view(valueStart, valueEnd - valueStart);
+			}
+
+			// Includes before this may define or undefine the same thing
+			finish_includes();
+
+			// Add define
+			add_define(wordDefine, wordValue);
+
+			// Expect end of line
+			expect_eol();
+		}
+
+	} else if (wordCommand == "undef") {
+		// #undef <word>
+		CCPP_STAT(directives[directive_undef]++);
+
+		if (isErasing) {
+			// Just consume the line if we're erasing
+			consume_line();
+
+		} else {
+			// Expect some whitespace
+			size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
+			if (lenCommandWhitespace == 0) {
+				return;
+			}
+			m_p += lenCommandWhitespace;
+
+			// Expect a define word
+			size_t lenDefine = lex_expect(m_p, m_pEnd, ELexType::Word);
+			if (lenDefine == 0) {
+				return;
+			}
+
+			std::string_view wordDefine(m_p, lenDefine);
+			m_p += lenDefine;
+
+			// Includes before this may define or undefine the same thing
+			finish_includes();
+
+			// Undefine
+			remove_define(wordDefine);
+
+			// Expect end of line
+			expect_eol();
+		}
+
+	} else if (wordCommand == "if") {
+		// #if <condition>
+		CCPP_STAT(directives[directive_if]++);
+
+		if (isErasing) {
+			// Just consume the line and push erasing at deep level
+			scope = Scope_Erasing | Scope_Deep;
+			m_stack.push(scope);
+			consume_line();
+
+		} else {
+			// Expect some whitespace
+			size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
+			if (lenCommandWhitespace == 0) {
+				return;
+			}
+			m_p += lenCommandWhitespace;
+
+			// Expect a condition
+			bool conditionPassed = test_condition();
+
+			// Push to the stack
+			scope = conditionPassed ? Scope_Passing : Scope_Erasing;
+			m_stack.push(scope);
+		}
+
+#if defined(CCPP_STATS)
+		if (m_stats != nullptr && m_stack.size() > m_stats->max_scope_depth) {
+			m_stats->max_scope_depth = m_stack.size();
+		}
+#endif
+
+	} else if (wordCommand == "else") {
+		// #else
+		CCPP_STAT(directives[directive_else]++);
+
+		if (isErasing && isDeep) {
+			// Just consume the line if we're deep
+			consume_line();
+
+		} else if (m_stack.size() == 0) {
+			// If the stack is empty, this is an invalid command
+			CCPP_ERROR("Unexpected #else on line %d", (int)line_at(m_p));
+			consume_line();
+
+		} else {
+			// Error out if we're already in an else directive
+			if (scope & Scope_Else) {
+				CCPP_ERROR("Unexpected #else on line %d", (int)line_at(m_p));
+
+			} else {
+				if (scope & Scope_Passing) {
+					// If we're passing, set scope to erasing else
+					scope = Scope_Erasing | Scope_Else;
+
+				} else if (scope & Scope_Erasing) {
+					// If we're erasing, set scope to passing else
+					scope = Scope_Passing | Scope_Else;
+				}
+				m_stack.set_top(scope);
+			}
+
+			// Expect end of line
+			expect_eol();
+		}
+
+	} else if (wordCommand == "elif") {
+		// #elif <condition>
+		CCPP_STAT(directives[directive_elif]++);
+
+		if (isErasing && isDeep) {
+			// Just consume the line if we're deep
+			consume_line();
+
+		} else if (m_stack.size() == 0) {
+			// If the stack is empty, this is an invalid command
+			CCPP_ERROR("Unexpected #elif on line %d", (int)line_at(m_p));
+			consume_line();
+
+		} else {
+			// Error out if we're already in an else directive
+			if (scope & Scope_Else) {
+				CCPP_ERROR("Unexpected #elif on line %d", (int)line_at(m_p));
+				consume_line();
+
+			} else {
+				if (scope & Scope_Passing) {
+					// If we're already passing, we'll erase anything below and set the deep flag to ignore the rest
+					scope = Scope_Erasing | Scope_ElseIf | Scope_Deep;
+					m_stack.set_top(scope);
+					consume_line();
+
+				} else {
+					// Expect some whitespace
+					size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
+					if (lenCommandWhitespace == 0) {
+						return;
+					}
+					m_p += lenCommandWhitespace;
+
+					// Expect a condition
+					bool conditionPassed = test_condition();
+
+					// Update the scope
+					scope = (conditionPassed ? Scope_Passing : Scope_Erasing) | Scope_ElseIf;
+					m_stack.set_top(scope);
+				}
+			}
+		}
+
+	} else if (wordCommand == "endif") {
+		// #endif
+		CCPP_STAT(directives[directive_endif]++);
+
+		if (m_stack.size() == 0) {
+			// If the stack is empty, this is an invalid command
+			CCPP_ERROR("Unexpected #endif on line %d", (int)line_at(m_p));
+			consume_line();
+
+		} else {
+			// Expect end of line
+			expect_eol();
+
+			// Pop from stack
+			m_stack.pop();
+			scope = m_stack.top();
+		}
+
+	} else if (wordCommand == "include") {
+		// #include <path>
+		CCPP_STAT(directives[directive_include]++);
+
+		if (isErasing) {
+			// Just consume the line if we're erasing
+			consume_line();
+
+		} else {
+			if (m_dependencies == nullptr && !m_config->m_includeCallback && !m_config->m_includeLoadCallback && m_config->m_prefetcher == nullptr) {
+				// If no callback is set up, just consume the line
+				CCPP_ERROR("No include callback set up for #include on line %d", (int)line_at(m_p));
+				consume_line();
+
+			} else {
+				// Expect some whitespace
+				size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
+				if (lenCommandWhitespace == 0) {
+					return;
+				}
+				m_p += lenCommandWhitespace;
 
-					// Expect end of line
-					expect_eol();
+				// Expect a string
+				size_t lenPath = lex_expect(m_p, m_pEnd, ELexType::String);
+				if (lenPath == 0) {
+					return;
 				}
 
-			} else if (!strcmp(wordCommand, "if")) {
-				// #if <condition>
+				// The path is between the quotes, the closing quote might be missing at the end of the buffer
+				size_t lenPathQuotes = (lenPath >= 2 && m_p[lenPath - 1] == '"') ? 2 : 1;
+				std::string_view path(m_p + 1, lenPath - lenPathQuotes);
 
-				if (isErasing) {
-					// Just consume the line and push erasing at deep level
-					m_stack.push(Scope_Erasing | Scope_Deep);
-					consume_line();
+				m_p += lenPath;
 
+				// Included content is placed after the include line, so it gets its own lines in the map
+				if (m_outputMode == output_mode::in_place) {
+					line_map_flush(line_at(m_p) + 1);
 				} else {
-					// Expect some whitespace
-					size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
-					if (lenCommandWhitespace == 0) {
-						continue;
-					}
-					m_p += lenCommandWhitespace;
-
-					// Expect a condition
-					bool conditionPassed = test_condition();
-
-					// Push to the stack
-					if (conditionPassed) {
-						m_stack.push(Scope_Passing);
-					} else {
-						m_stack.push(Scope_Erasing);
-					}
+					keep(commandStart);
+					line_map_flush(line_at(m_p));
 				}
 
-			} else if (!strcmp(wordCommand, "else")) {
-				// #else
+				if (m_dependencies != nullptr) {
+					m_dependencies->add(path);
 
-				if (isErasing && isDeep) {
-					// Just consume the line if we're deep
-					consume_line();
+				} else if (m_config->m_includeLoadCallback || m_config->m_prefetcher != nullptr) {
+					load_include(path);
 
-				} else if (m_stack.size() == 0) {
-					// If the stack is empty, this is an invalid command
-					CCPP_ERROR("Unexpected #else on line %d", (int)m_line);
-					consume_line();
+					// A line map needs the included content right here
+					if (m_lineMap != nullptr || m_pendingIncludes.size() >= CCPP_MAX_PENDING_INCLUDES) {
+						finish_includes();
+					}
 
 				} else {
-					// Get top of stack
-					uint32_t &top = m_stack.top();
-
-					// Error out if we're already in an else directive
-					if (top & Scope_Else) {
-						CCPP_ERROR("Unexpected #else on line %d", (int)m_line);
+					// Run callback
+					bool included;
+					{
+						CCPP_STAT(include_count++);
+						CCPP_STAT_TIMER(include_time_ns);
+
+						if (m_tracer != nullptr) {
+							m_tracer->begin("include", path.data(), path.size());
+						}
 
-					} else {
-						if (top & Scope_Passing) {
-							// If we're passing, set scope to erasing else
-							top = Scope_Erasing | Scope_Else;
+						included = m_config->m_includeCallback(path);
 
-						} else if (top & Scope_Erasing) {
-							// If we're erasing, set scope to passing else
-							top = Scope_Passing | Scope_Else;
+						if (m_tracer != nullptr) {
+							m_tracer->end();
 						}
 					}
 
-					// Expect end of line
-					expect_eol();
+					if (!included) {
+						CCPP_ERROR("Failed to include \"%.*s\" on line %d", (int)path.size(), path.data(), (int)line_at(m_p));
+					}
 				}
 
-			} else if (!strcmp(wordCommand, "elif")) {
-				// #elif <condition>
+				line_map_resume(line_at(m_p) + 1);
 
-				if (isErasing && isDeep) {
-					// Just consume the line if we're deep
-					consume_line();
+				// Expect end of line
+				expect_eol();
+			}
+		}
 
-				} else if (m_stack.size() == 0) {
-					// If the stack is empty, this is an invalid command
-					CCPP_ERROR("Unexpected #elif on line %d", (int)m_line);
-					consume_line();
+	} else {
+		// Unknown command, it can be handled by the callback, or throw an error
+		CCPP_STAT(directives[directive_command]++);
+		bool commandFound = false;
+		int line = (int)line_at(m_p);
 
-				} else {
-					// Get top of stack
-					uint32_t &top = m_stack.top();
-
-					// Error out if we're already in an else directive
-					if (top & Scope_Else) {
-						CCPP_ERROR("Unexpected #elif on line %d", (int)m_line);
-						consume_line();
-
-					} else {
-						if (top & Scope_Passing) {
-							// If we're already passing, we'll erase anything below and set the deep flag to ignore the rest
-							top = Scope_Erasing | Scope_ElseIf | Scope_Deep;
-							consume_line();
-
-						} else {
-							// Expect some whitespace
-							size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
-							if (lenCommandWhitespace == 0) {
-								continue;
-							}
-							m_p += lenCommandWhitespace;
-
-							// Expect a condition
-							bool conditionPassed = test_condition();
-
-							// Update the scope
-							if (conditionPassed) {
-								top = Scope_Passing | Scope_ElseIf;
-							} else {
-								top = Scope_Erasing | Scope_ElseIf;
-							}
-						}
-					}
-				}
+		char* commandValueStart = m_p;
 
-			} else if (!strcmp(wordCommand, "endif")) {
-				// #endif
+		// Consume until end of line
+		consume_line();
 
-				if (m_stack.size() == 0) {
-					// If the stack is empty, this is an invalid command
-					CCPP_ERROR("Unexpected #endif on line %d", (int)m_line);
-					consume_line();
+		// Handle if not erasing, commands are left alone when scanning
+		if (!isErasing && m_dependencies == nullptr) {
+			// See if there is a custom command callback
+			if (m_config->m_commandCallback) {
+				// Includes before the command reach the callbacks first, like they do when they aren't loaded async
+				finish_includes();
 
-				} else {
-					// Expect end of line
-					expect_eol();
+				CCPP_STAT(command_count++);
+				CCPP_STAT_TIMER(command_time_ns);
 
-					// Pop from stack
-					m_stack.pop();
+				ELexType typeCommandValue;
+				size_t lenCommandValue = lex(commandValueStart, m_pEnd, typeCommandValue);
+
+				if (typeCommandValue == ELexType::Whitespace) {
+					// Handle potential whitespace
+					commandValueStart += lenCommandValue;
+					lenCommandValue = lex(commandValueStart, m_pEnd, typeCommandValue);
 				}
 
-			} else if (!strcmp(wordCommand, "include")) {
-				// #include <path>
+				// If end of line, there's no command value
+				std::string_view commandValue;
 
-				if (isErasing) {
-					// Just consume the line if we're erasing
-					consume_line();
+				if (typeCommandValue != ELexType::Newline) {
+					// If not end of line yet, there's some value
+					commandValue = std::string_view(commandValueStart, lenCommandValue);
+				}
 
-				} else {
-					if (m_includeCallback == nullptr) {
-						// If no callback is set up, just consume the line
-						CCPP_ERROR("No include callback set up for #include on line %d", (int)m_line);
-						consume_line();
-
-					} else {
-						// Expect some whitespace
-						size_t lenCommandWhitespace = lex_expect(m_p, m_pEnd, ELexType::Whitespace);
-						if (lenCommandWhitespace == 0) {
-							continue;
-						}
-						m_p += lenCommandWhitespace;
+				if (m_tracer != nullptr) {
+					m_tracer->begin("command", wordCommand.data(), wordCommand.size());
+				}
 
-						// Expect a string
-						size_t lenPath = lex_expect(m_p, m_pEnd, ELexType::String);
-						if (lenPath == 0) {
-							continue;
-						}
+				commandFound = m_config->m_commandCallback(wordCommand, commandValue);
 
-						char* path = (char*)alloca(lenPath);
-						memcpy(path, m_p + 1, lenPath - 2);
-						path[lenPath - 2] = '\0';
+				if (m_tracer != nullptr) {
+					m_tracer->end();
+				}
+			}
 
-						m_p += lenPath;
+			if (!commandFound) {
+				CCPP_ERROR("Unrecognized preprocessor command \"%.*s\" on line %d", (int)wordCommand.size(), wordCommand.data(), line);
+			}
+		}
+	}
 
-						// Run callback
-						if (!m_includeCallback(path)) {
-							CCPP_ERROR("Failed to include \"%s\" on line %d", path, (int)m_line);
-						}
+	CCPP_STAT(bytes_directives += m_p - commandStart);
+	erase(commandStart, m_p);
+}
 
-						// Expect end of line
-						expect_eol();
-					}
-				}
+bool ccpp::session::test_condition()
+{
+	CCPP_STAT(condition_evaluations++);
+
+	// Definitions made by the includes before this count in the condition
+	finish_includes();
+
+	condition_parser cp;
+	cp.session = this;
+	cp.p = m_p;
+	cp.pEnd = m_pEnd;
+	cp.line = (int)line_at(m_p);
+	cp.depth = 0;
+	cp.nesting = 0;
+	cp.skip = 0;
+	cp.error = false;
+
+	int64_t result = cond_parse_expression(cp, 0);
+
+	// The condition must be followed by the end of the line
+	cond_skip_whitespace(cp);
+	if (!cond_is_end(cp)) {
+		cond_unexpected(cp);
+	}
 
-			} else {
-				// Unknown command, it can be handled by the callback, or throw an error
-				bool commandFound = false;
-				int line = (int)m_line;
+	// Consume the rest of the line
+	m_p = (char*)cp.p;
+	consume_line();
 
-				char* commandValueStart = m_p;
+	if (cp.error) {
+		return false;
+	}
+	return result != 0;
+}
 
-				// Consume until end of line
-				consume_line();
+void ccpp::session::expect_eol()
+{
+	// Consider the end of the string as end of line too
+	if (m_p == m_pEnd) {
+		return;
+	}
 
-				// Handle if not erasing
-				if (!isErasing) {
-					// See if there is a custom command callback
-					if (m_commandCallback != nullptr) {
-						ELexType typeCommandValue;
-						size_t lenCommandValue = lex(commandValueStart, m_pEnd, typeCommandValue);
-
-						if (typeCommandValue == ELexType::Whitespace) {
-							// Handle potential whitespace
-							commandValueStart += lenCommandValue;
-							lenCommandValue = lex(commandValueStart, m_pEnd, typeCommandValue);
-						}
+	size_t lenNewline = lex_expect(m_p, m_pEnd, ELexType::Newline);
+	if (lenNewline == 0) {
+		return;
+	}
+
+	m_p += lenNewline;
+}
+
+void ccpp::session::consume_line()
+{
+	ELexType type = ELexType::None;
+	while (type != ELexType::Newline && m_p < m_pEnd) {
+		m_p += lex(m_p, m_pEnd, type);
+	}
+}
 
-						if (typeCommandValue == ELexType::Newline) {
-							// If end of line, there's no command value
-							commandFound = m_commandCallback(wordCommand, nullptr);
+bool ccpp::session::skip_region(bool isErasing)
+{
+	char* regionStart = m_p;
+	char* regionEnd = scan_region_end(regionStart, m_pEnd);
+	if (regionEnd == nullptr) {
+		return false;
+	}
 
-						} else {
-							// If not end of line yet, there's some value
-							char* commandValue = (char*)alloca(lenCommandValue + 1);
-							memcpy(commandValue, commandValueStart, lenCommandValue);
-							commandValue[lenCommandValue] = '\0';
+	if (isErasing) {
+		CCPP_STAT(bytes_erased += regionEnd - regionStart);
+		erase(regionStart, regionEnd);
 
-							commandFound = m_commandCallback(wordCommand, commandValue);
-						}
-					}
+	} else if (m_outputMode == output_mode::minify) {
+		keep(regionStart);
 
-					if (!commandFound) {
-						CCPP_ERROR("Unrecognized preprocessor command \"%s\" on line %d", wordCommand, line);
-					}
-				}
-			}
+		// Lines have to be counted before the output is written over them
+		size_t lineEnd = line_at(regionEnd);
 
-			overwrite(commandStart, m_p - commandStart);
+		if (*regionStart == '/' && m_stripComments) {
+			// Drop the comment, but don't let the tokens around it touch
+			m_minifyLine = lineEnd;
+			m_minifySpace = m_minifyContent;
+		} else {
+			minify_verbatim(regionStart, regionEnd);
 		}
+
+		m_keep = regionEnd;
 	}
 
-	// If there's something left in the stack, there are unclosed commands (missing #endif etc.)
-	if (m_stack.size() > 0) {
-		CCPP_ERROR("%d preprocessor scope(s) left unclosed at end of file (did you forget \"#endif\"?)", (int)m_stack.size());
+	m_p = regionEnd;
+	return true;
+}
+
+void ccpp::session::line_map_flush(size_t line)
+{
+	// Minify mode marks the map as it writes lines
+	if (m_outputMode == output_mode::minify) {
+		return;
 	}
 
-	m_p = nullptr;
-	m_pEnd = nullptr;
+	if (m_lineMap == nullptr || line <= m_lineMapLine) {
+		return;
+	}
+
+	m_lineMap->advance((uint32_t)(line - m_lineMapLine));
+	m_lineMapLine = line;
 }
 
-bool ccpp::processor::test_condition()
+void ccpp::session::line_map_resume(size_t line)
 {
-	//TODO:
-	// ()
+	if (m_lineMap == nullptr || m_outputMode == output_mode::minify) {
+		return;
+	}
+
+	m_lineMap->mark(m_lineMapFile, (uint32_t)line);
+	m_lineMapLine = line;
+}
 
-	std::vector<uint32_t> conditions;
+void ccpp::session::hash_output(const char* pEnd)
+{
+	m_outputHasher->update(m_hashed, pEnd - m_hashed);
+	m_hashed = pEnd;
+}
 
-	uint32_t opFlag = 0;
+size_t ccpp::session::line_at(const char* p)
+{
+	if (p >= m_lineAt) {
+		m_line += scan_count(m_lineAt, p, '\n');
+	} else {
+		m_line -= scan_count(p, m_lineAt, '\n');
+	}
+	m_lineAt = p;
+	return m_line;
+}
 
-	while (true) {
-		ELexType type;
-		char* symStart;
-		size_t symLength;
+void ccpp::session::erase(char* p, char* pEnd)
+{
+	if (m_recordErased) {
+		if (!m_erased.empty() && m_erased.back().pEnd == p) {
+			m_erased.back().pEnd = pEnd;
+		} else {
+			m_erased.push_back({ p, pEnd });
+		}
+		return;
+	}
 
-		m_p += lex_next(m_p, m_pEnd, type, &symStart, &symLength);
+	if (m_outputMode == output_mode::in_place) {
+		if (m_dependencies == nullptr) {
+			overwrite(p, pEnd - p);
 
-		if (type == ELexType::Newline) {
-			m_line++;
-			m_column = 0;
-			break;
+			// Nothing before the end of an erased part changes anymore
+			if (m_outputHasher != nullptr && (size_t)(pEnd - m_hashed) >= output_hash_chunk) {
+				hash_output(pEnd);
+			}
 		}
+		return;
+	}
 
-		uint32_t cond = 0;
-		bool mustEqual = true;
+	// Move the content that was kept before this into place
+	keep(p);
+	m_keep = pEnd;
 
-		if (type == ELexType::Operator) {
-			if (*symStart == '!') {
-				mustEqual = false;
+	// Lines are only needed for the line map
+	if (m_lineMap != nullptr) {
+		size_t lineStart = line_at(p);
+		size_t lineEnd = line_at(pEnd);
 
-			} else if (symLength == 2 && !strncmp(symStart, "&&", symLength)) {
-				opFlag = Match_OpAnd;
-				continue;
+		m_minifyLine = lineEnd;
 
-			} else if (symLength == 2 && !strncmp(symStart, "||", symLength)) {
-				opFlag = Match_OpOr;
-				continue;
+		line_map_flush(lineStart);
+		line_map_resume(lineEnd);
+	}
+}
 
-			} else {
-				char* operatorText = (char*)alloca(symLength + 1);
-				memcpy(operatorText, symStart, symLength);
-				operatorText[symLength] = '\0';
-				CCPP_ERROR("Unexpected operator '%s' in condition on line %d", operatorText, (int)m_line);
-			}
-			m_p += lex_next(m_p, m_pEnd, type, &symStart, &symLength);
+void ccpp::session::erase_text(char* p, char* pEnd)
+{
+	CCPP_STAT(bytes_erased += (pEnd - p) - scan_count(p, pEnd, '\n'));
+	erase(p, pEnd);
+}
+
+void ccpp::session::keep(char* p)
+{
+	if (p <= m_keep || m_recordErased) {
+		return;
+	}
+
+	// Lines are counted before the output is written over them
+	line_at(p);
+
+	if (m_outputMode == output_mode::minify) {
+		minify(m_keep, p);
+	} else {
+		size_t lenKeep = p - m_keep;
+		if (m_out != m_keep) {
+			memmove(m_out, m_keep, lenKeep);
 		}
+		m_out += lenKeep;
+	}
+
+	m_keep = p;
+
+	if (m_outputHasher != nullptr && (size_t)(m_out - m_hashed) >= output_hash_chunk) {
+		hash_output(m_out);
+	}
+}
+
+void ccpp::session::minify(const char* p, const char* pEnd)
+{
+	// The output never catches up with the input, since every written character (including a
+	// collapsed space) stands for at least one character that was already read
+	for (; p < pEnd; p++) {
+		char c = *p;
+
+		if (c == '\n') {
+			// Drop blank lines
+			if (m_minifyContent) {
+				*m_out++ = '\n';
+				if (m_lineMap != nullptr) {
+					m_lineMap->advance(1);
+				}
+			}
+			m_minifyContent = false;
+			m_minifySpace = false;
+			m_minifyLine++;
+
+		} else if (c == ' ' || c == '\t' || c == '\r') {
+			// Collapse whitespace, dropping it at the start of a line
+			m_minifySpace = m_minifyContent;
 
-		if (type != ELexType::Word) {
-			CCPP_ERROR("Unexpected %s in condition on line %d", lex_type_name(type), (int)m_line);
 		} else {
-			std::string word(symStart, symLength);
-			if (has_define(word.c_str()) == mustEqual) {
-				cond = Match_Pass;
+			if (!m_minifyContent && m_lineMap != nullptr) {
+				m_lineMap->mark(m_lineMapFile, (uint32_t)m_minifyLine);
+			}
+			if (m_minifySpace) {
+				*m_out++ = ' ';
+				m_minifySpace = false;
 			}
+			*m_out++ = c;
+			m_minifyContent = true;
 		}
+	}
+}
 
-		conditions.emplace_back(cond | opFlag);
+void ccpp::session::minify_verbatim(const char* p, const char* pEnd)
+{
+	if (!m_minifyContent && m_lineMap != nullptr) {
+		m_lineMap->mark(m_lineMapFile, (uint32_t)m_minifyLine);
+	}
+	if (m_minifySpace) {
+		*m_out++ = ' ';
+		m_minifySpace = false;
 	}
 
-	// Perform AND conditions first
-	for (int i = (int)conditions.size() - 1; i >= 1; i--) {
-		uint32_t &rhs = conditions[i];
-		uint32_t &lhs = conditions[i - 1];
+	size_t len = pEnd - p;
+	memmove(m_out, p, len);
+	m_out += len;
+	m_minifyContent = true;
 
-		if (rhs & Match_OpAnd) {
-			if ((rhs & Match_Pass) && (lhs & Match_Pass)) {
-				lhs |= Match_Pass;
-			} else {
-				lhs &= ~Match_Pass;
-			}
-			conditions.erase(conditions.begin() + i);
+	// Strings may span multiple lines
+	for (const char* n = (const char*)memchr(p, '\n', len); n != nullptr; n = (const char*)memchr(n + 1, '\n', pEnd - n - 1)) {
+		m_minifyLine++;
+		if (m_lineMap != nullptr) {
+			m_lineMap->advance(1);
 		}
 	}
+}
 
-	// Perform OR conditions last
-	for (int i = (int)conditions.size() - 1; i >= 1; i--) {
-		uint32_t &rhs = conditions[i];
-		uint32_t &lhs = conditions[i - 1];
+void ccpp::session::load_include(std::string_view path)
+{
+	// The path is overwritten once the include is erased, so it's kept until the include is finished
+	pending_include inc;
+	inc.path = m_pendingPaths.size();
+	inc.lenPath = path.size();
+	inc.line = line_at(m_p);
+	m_pendingPaths.insert(m_pendingPaths.end(), path.begin(), path.end());
+
+	if (m_config->m_prefetcher != nullptr) {
+		inc.content = m_config->m_prefetcher->load(path);
+	} else {
+		inc.content = m_config->m_includeLoadCallback(path);
+	}
+	m_pendingIncludes.emplace_back(std::move(inc));
+}
 
-		if (rhs & Match_OpOr) {
-			if ((rhs & Match_Pass) || (lhs & Match_Pass)) {
-				lhs |= Match_Pass;
-			} else {
-				lhs &= ~Match_Pass;
+void ccpp::session::finish_includes()
+{
+	for (pending_include &inc : m_pendingIncludes) {
+		std::string_view path(m_pendingPaths.data() + inc.path, inc.lenPath);
+
+		bool included = false;
+		{
+			CCPP_STAT(include_count++);
+			CCPP_STAT_TIMER(include_time_ns);
+
+			if (m_tracer != nullptr) {
+				m_tracer->begin("include", path.data(), path.size());
+			}
+
+			if (inc.content.valid()) {
+				std::optional<std::string> content = inc.content.get();
+				if (content) {
+					included = m_config->m_includeReadyCallback(path, *content);
+				}
+			}
+
+			if (m_tracer != nullptr) {
+				m_tracer->end();
 			}
-			conditions.erase(conditions.begin() + i);
+		}
+
+		if (!included) {
+			CCPP_ERROR("Failed to include \"%.*s\" on line %d", (int)path.size(), path.data(), (int)inc.line);
 		}
 	}
 
-	// Now there should only be 1 condition left
-	CCPP_ASSERT(conditions.size() == 1);
-	if (conditions.size() != 1) {
-		return false;
+	m_pendingIncludes.clear();
+	m_pendingPaths.clear();
+}
+
+void ccpp::session::overwrite(char* p, size_t len)
+{
+	char* pEnd = p + len;
+	for (; p < pEnd; p++) {
+		if (*p != '\r' && *p != '\n') {
+			*p = ' ';
+		}
 	}
-	return (conditions[0] & Match_Pass);
 }
 
-void ccpp::processor::expect_eol()
+
+ccpp::processor::processor(allocator* alloc)
+	: m_config(alloc)
+	, m_session(m_config)
 {
-	// Consider the end of the string as end of line too
-	if (m_p == m_pEnd) {
-		return;
+}
+
+ccpp::processor::processor(const processor &copy)
+	: m_config(copy.m_config)
+	, m_session(m_config)
+{
+}
+
+// While processing, definitions go through the session
+
+void ccpp::processor::add_define(const char* name, const char* value)
+{
+	add_define(std::string_view(name), (value != nullptr) ? std::string_view(value) : std::string_view());
+}
+
+void ccpp::processor::add_define(std::string_view name, std::string_view value)
+{
+	if (m_session.m_p != nullptr) {
+		m_session.add_define(name, value);
+	} else {
+		m_config.add_define(name, value);
 	}
+}
 
-	if (lex_expect(m_p, m_pEnd, ELexType::Newline) == 0) {
-		return;
+void ccpp::processor::remove_define(const char* name)
+{
+	remove_define(std::string_view(name));
+}
+
+void ccpp::processor::remove_define(std::string_view name)
+{
+	if (m_session.m_p != nullptr) {
+		m_session.remove_define(name);
+	} else {
+		m_config.remove_define(name);
 	}
+}
 
-	m_p++;
+bool ccpp::processor::has_define(const char* name) const
+{
+	return m_session.has_define(name);
+}
 
-	m_line++;
-	m_column = 0;
+bool ccpp::processor::has_define(std::string_view name) const
+{
+	return m_session.has_define(name);
 }
 
-void ccpp::processor::consume_line()
+const char* ccpp::processor::get_define(const char* name) const
 {
-	ELexType type = ELexType::None;
-	while (type != ELexType::Newline) {
-		m_p += lex(m_p, m_pEnd, type);
-	}
+	return m_session.get_define(name);
+}
 
-	m_line++;
-	m_column = 0;
+const char* ccpp::processor::get_define(std::string_view name) const
+{
+	return m_session.get_define(name);
 }
 
-void ccpp::processor::overwrite(char* p, size_t len)
+void ccpp::processor::set_include_callback(config::include_callback_t callback)
 {
-	char* pEnd = p + len;
-	for (; p < pEnd; p++) {
-		if (*p != '\r' && *p != '\n') {
-			*p = ' ';
+	m_config.set_include_callback(callback);
+}
+
+void ccpp::processor::set_command_callback(config::command_callback_t callback)
+{
+	m_config.set_command_callback(callback);
+}
+
+void ccpp::processor::set_async_include_callbacks(config::include_load_callback_t load, config::include_ready_callback_t ready)
+{
+	m_config.set_async_include_callbacks(load, ready);
+}
+
+void ccpp::processor::set_include_prefetcher(prefetcher* prefetcher)
+{
+	m_config.set_include_prefetcher(prefetcher);
+}
+
+void ccpp::processor::set_snapshot(const snapshot* snapshot)
+{
+	m_config.set_snapshot(snapshot);
+}
+
+void ccpp::processor::set_language_aware(bool enabled)
+{
+	m_config.set_language_aware(enabled);
+}
+
+void ccpp::processor::set_line_map(line_map* map, uint32_t file)
+{
+	m_session.set_line_map(map, file);
+}
+
+void ccpp::processor::set_output_mode(output_mode mode)
+{
+	m_config.set_output_mode(mode);
+}
+
+void ccpp::processor::set_strip_comments(bool strip)
+{
+	m_config.set_strip_comments(strip);
+}
+
+void ccpp::processor::set_stats(stats* stats)
+{
+	m_session.set_stats(stats);
+}
+
+void ccpp::processor::set_tracer(tracer* tracer)
+{
+	m_session.set_tracer(tracer);
+}
+
+void ccpp::processor::set_output_hasher(hasher* hasher)
+{
+	m_session.set_output_hasher(hasher);
+}
+
+size_t ccpp::processor::process(char* buffer)
+{
+	return process(buffer, strlen(buffer));
+}
+
+size_t ccpp::processor::process(char* buffer, size_t len)
+{
+	size_t ret = m_session.process(buffer, len);
+	keep_defines();
+	return ret;
+}
+
+size_t ccpp::processor::process_parallel(char* buffer, size_t len, size_t threads)
+{
+	size_t ret = m_session.process_parallel(buffer, len, threads);
+	keep_defines();
+	return ret;
+}
+
+void ccpp::processor::keep_defines()
+{
+	// Keep the definitions made while processing for the next run
+	if (m_session.m_p == nullptr) {
+		for (const session::define &def : m_session.m_defines) {
+			if (def.second == nullptr) {
+				m_config.remove_define(def.first);
+			} else {
+				// The run may have undefined a definition of the config and defined it again
+				if (m_config.has_define(def.first)) {
+					m_config.remove_define(def.first);
+				}
+				m_config.add_define(def.first, def.second);
+			}
 		}
+		m_session.clear_defines();
 	}
 }
 